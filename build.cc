@@ -4,6 +4,8 @@
 #include "build.h"
 #include "rules.h"
 #include "exception.h"
+#include "stats.h"
+#include "subprocess.h"
 
 using namespace std;
 
@@ -26,6 +28,26 @@ void set_plotter(Plotter *p)
     Rule::setPlotter(p);
 }
 
+void set_one_shell(bool oneShell)
+{
+    Rule::setOneShell(oneShell);
+}
+
+void set_use_depfiles(bool useDepfiles)
+{
+    Rule::setUseDepfiles(useDepfiles);
+}
+
+void set_trust(unsigned int runs, unsigned int every)
+{
+    Rule::setTrust(runs, every);
+}
+
+void add_system_prefix(string prefix)
+{
+    Rule::addSystemPrefix(prefix);
+}
+
 void set_target(string target)
 {
     targets.push_back(target);
@@ -49,5 +71,9 @@ int build_targets()
             ret = 1;
         }
     }
+    if( stats_enabled() ) {
+        stats_report( cout );
+        subprocess_report( cout );
+    }
     return ret;
 }
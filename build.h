@@ -15,6 +15,29 @@ void set_default_target();
  */
 void set_plotter(Plotter *p);
 
+/*
+ * Run all the commands of each rule in a single shell
+ */
+void set_one_shell(bool oneShell);
+
+/*
+ * Take the dependencies of compilers run with -MD or -MMD from the files
+ * they write, rather than tracing them
+ */
+void set_use_depfiles(bool useDepfiles);
+
+/*
+ * Stop tracing targets whose dependencies have been the same for a number
+ * of builds, tracing them again every so often
+ */
+void set_trust(unsigned int runs, unsigned int every);
+
+/*
+ * Treat paths under a prefix as part of the toolchain, recorded by
+ * fingerprint rather than for each rule
+ */
+void add_system_prefix(std::string prefix);
+
 /*
  * Sets a specified target that the user wants to build.
  */
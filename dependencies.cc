@@ -1,6 +1,7 @@
 #include <db.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <string>
 #include <list>
 #include <set>
@@ -9,16 +10,28 @@
 #include <iostream>
 #include <sstream>
 #include "utilities.h"
+#include "stats.h"
 
 using namespace std;
 
 string depfile = "makefile.dep";
 static DB *dbp;
 
+// Stored under its own key, which is shorter than a hash. It changes whenever
+// the names records are keyed by do, such as when canonical names became
+// absolute and rules' names started being canonicalized as they're used, so
+// a database written before is started again rather than half found.
+#define FORMAT_KEY "*format"
+#define FORMAT_VERSION "2"
+
+void dependencies_reset();
+
 void dependencies_init()
 {
+    DBT key, data;
     int ret;
     u_int32_t flags;
+    bool existed = access( depfile.c_str(), F_OK ) == 0;
 
     ret = db_create( &dbp, NULL, 0);
     if( ret != 0 ) {
@@ -38,6 +51,29 @@ void dependencies_init()
         dbp->close(dbp, 0);
         throw runtime_wexception("Failed to open database");
     }
+
+    memset( &key, 0, sizeof(DBT) );
+    memset( &data, 0, sizeof(DBT) );
+    key.data = (void *)FORMAT_KEY;
+    key.size = sizeof(FORMAT_KEY) - 1;
+    ret = dbp->get(dbp, NULL, &key, &data, 0);
+    if( ret == 0 && string( (const char *)data.data, data.size ) == FORMAT_VERSION ) return;
+    if( ret != 0 && ret != DB_NOTFOUND ) {
+        dbp->close(dbp, 0);
+        throw runtime_wexception("Failed to read database format");
+    }
+    if( existed ) {
+        cerr << depfile << " was written by another version of ptmake, so everything will be rebuilt" << endl;
+        dependencies_reset();
+        return;
+    }
+
+    data.data = (void *)FORMAT_VERSION;
+    data.size = sizeof(FORMAT_VERSION) - 1;
+    ret = dbp->put(dbp, NULL, &key, &data, 0);
+    if( ret != 0 ) {
+        throw runtime_wexception("Could not insert record");
+    }
 }
 
 void dependencies_deinit()
@@ -67,7 +103,11 @@ void clear_dependencies(const unsigned char hash[32])
     key.size = 32;
     key.flags = 0;
 
-    ret = dbp->del(dbp, NULL, &key, 0);
+    {
+        StatsTimer timer( STAT_DB_TIME );
+        stats_add( STAT_DB );
+        ret = dbp->del(dbp, NULL, &key, 0);
+    }
 
     // Database corrupt
     if( ret == DB_PAGE_NOTFOUND ) {
@@ -101,7 +141,11 @@ void add_dependencies(const unsigned char hash[32], const std::set<std::pair<std
         data.data = (void *)tempBuf;
         data.size = i->first.length()+2;
 
-        ret = dbp->put(dbp, NULL, &key, &data, 0);
+        {
+            StatsTimer timer( STAT_DB_TIME );
+            stats_add( STAT_DB );
+            ret = dbp->put(dbp, NULL, &key, &data, 0);
+        }
         if( ret != 0 ) {
             throw runtime_wexception("Could not insert record");
         }
@@ -121,6 +165,7 @@ list<pair<string, bool> > *retrieve_dependencies(const unsigned char hash[32])
         cout << "Retrieving dependencies for " << printhash(hash) << endl;
     }
 
+    StatsTimer timer( STAT_DB_TIME );
     dbp->cursor(dbp, NULL, &cursor, 0 );
 
     memset( &key, 0, sizeof(DBT) );
@@ -131,12 +176,14 @@ list<pair<string, bool> > *retrieve_dependencies(const unsigned char hash[32])
 
     data.flags = DB_DBT_REALLOC;
 
+    stats_add( STAT_DB );
     ret = cursor->get(cursor, &key, &data, DB_SET);
     while( ret == 0 ) {
         if( deps == NULL ) {
             deps = new list<pair<string, bool> >;
         }
         deps->push_back(pair<string,bool>(string((const char *)data.data, (string::size_type)data.size - 2), ((char *)data.data)[ data.size - 1 ]));
+        stats_add( STAT_DB );
         ret = cursor->get(cursor, &key, &data, DB_NEXT_DUP);
     }
     if( data.data != NULL ) {
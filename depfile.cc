@@ -0,0 +1,144 @@
+#include <ctype.h>
+#include <fstream>
+#include <vector>
+#include "depfile.h"
+
+using namespace std;
+
+// Whether a program is a C or C++ compiler driver, with any version suffix,
+// as in gcc-12 or x86_64-linux-gnu-g++
+static bool is_compiler(string name)
+{
+    size_t slash, end;
+
+    slash = name.find_last_of( '/' );
+    if( slash != string::npos ) name.erase( 0, slash + 1 );
+
+    end = name.find_last_not_of( "0123456789." );
+    if( end != string::npos && end + 1 < name.length() && name[ end ] == '-' ) {
+        name.erase( end );
+    }
+
+    // cc, gcc, c++, g++, clang and clang++
+    if( name.length() >= 2 && (!name.compare( name.length() - 2, 2, "cc" ) || !name.compare( name.length() - 2, 2, "++" )) ) {
+        return true;
+    }
+    return name.length() >= 5 && !name.compare( name.length() - 5, 5, "clang" );
+}
+
+// Whether a program runs the command it's given, such as a compiler cache
+static bool is_wrapper(string name)
+{
+    size_t slash;
+
+    slash = name.find_last_of( '/' );
+    if( slash != string::npos ) name.erase( 0, slash + 1 );
+
+    return name == "ccache" || name == "sccache" || name == "distcc" || name == "icecc";
+}
+
+bool depfile_for_command(const string &command, string *depfile)
+{
+    vector<string> args;
+    string output;
+    size_t start, end, dot, first;
+    bool writes = false;
+
+    // Anything the shell would have to take apart could run more than the
+    // compiler
+    if( command.find_first_of( "\n;|&<>`$()'\"\\*?" ) != string::npos ) return false;
+
+    for( start = command.find_first_not_of( " \t" ); start != string::npos; start = command.find_first_not_of( " \t", end ) ) {
+        end = command.find_first_of( " \t", start );
+        args.push_back( command.substr( start, end - start ) );
+        if( end == string::npos ) break;
+    }
+    for( first = 0; first < args.size() && is_wrapper( args[ first ] ); first ++ );
+    if( first == args.size() || !is_compiler( args[ first ] ) ) return false;
+
+    depfile->clear();
+    for( size_t i = first + 1; i < args.size(); i ++ ) {
+        const string &a = args[ i ];
+
+        if( a == "-MD" || a == "-MMD" ) {
+            writes = true;
+        } else if( a == "-M" || a == "-MM" ) {
+            // The dependencies go to the output instead
+            return false;
+        } else if( a == "-MF" || a == "-o" ) {
+            if( i + 1 == args.size() ) return false;
+            (a == "-o" ? output : *depfile) = args[ ++ i ];
+        } else if( !a.compare( 0, 3, "-MF" ) ) {
+            *depfile = a.substr( 3 );
+        } else if( !a.compare( 0, 2, "-o" ) ) {
+            output = a.substr( 2 );
+        }
+    }
+    if( !writes ) return false;
+
+    if( depfile->empty() ) {
+        if( output.empty() ) return false;
+        dot = output.find_last_of( "./" );
+        if( dot != string::npos && output[ dot ] == '.' ) output.erase( dot );
+        *depfile = output + ".d";
+    }
+    return true;
+}
+
+bool parse_depfile(const string &file, list<string> *deps)
+{
+    string text, word;
+    bool target = true;
+    size_t i, length;
+    char c;
+
+    // Read in one go; they're small, and this is done for most rules
+    ifstream in( file.c_str(), ios::binary );
+    if( !in || !in.seekg( 0, ios::end ) ) return false;
+    text.resize( in.tellg() );
+    in.seekg( 0, ios::beg );
+    in.read( &text[ 0 ], text.size() );
+    length = in.gcount();
+
+    for( i = 0; i <= length; i ++ ) {
+        c = i < length ? text[ i ] : '\n';
+
+        if( c == '\\' && i + 1 < length ) {
+            // A line continuation, or an escaped space or #
+            c = text[ i + 1 ];
+            if( c == '\r' && i + 2 < length && text[ i + 2 ] == '\n' ) {
+                i ++;
+                c = '\n';
+            }
+            if( c == '\n' || c == ' ' || c == '#' ) {
+                i ++;
+                if( c != '\n' ) {
+                    word += c;
+                    continue;
+                }
+                c = ' ';
+            } else {
+                c = '\\';
+            }
+        } else if( c == '$' && i + 1 < length && text[ i + 1 ] == '$' ) {
+            i ++;
+        } else if( c == ':' && target && (i + 1 >= length || isspace( (unsigned char)text[ i + 1 ] )) ) {
+            // The end of the targets
+            word.clear();
+            target = false;
+            continue;
+        } else if( c == '\r' ) {
+            continue;
+        }
+
+        if( c == ' ' || c == '\t' || c == '\n' ) {
+            if( !word.empty() && !target ) deps->push_back( word );
+            word.clear();
+            // Each line is a new rule, such as the empty ones -MP adds
+            if( c == '\n' ) target = true;
+            continue;
+        }
+        word += c;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef __DEPFILE_H__
+#define __DEPFILE_H__
+
+#include <list>
+#include <string>
+
+/*
+ * Make-style dependency files, as written by compilers given -MD or -MMD
+ */
+
+/*
+ * Find the dependency file a command will write, if it's a compiler run with
+ * -MD or -MMD and nothing else, maybe through a wrapper such as ccache. The
+ * file is the one given with -MF, or else the output file with its suffix
+ * replaced by .d.
+ */
+bool depfile_for_command(const std::string &command, std::string *depfile);
+
+/*
+ * Read the prerequisites listed in a dependency file, in the order they
+ * appear, leaving out the targets. Returns false if it can't be read.
+ */
+bool parse_depfile(const std::string &file, std::list<std::string> *deps);
+
+#endif /* __DEPFILE_H__ */
@@ -32,10 +32,23 @@ bool fileIsAbsolute( const std::string &file );
  */
 bool fileExists(const std::string &file);
 
+/*
+ * Return whether the specified file exists and is a regular file, rather
+ * than a directory or a device
+ */
+bool fileIsRegular(const std::string &file);
+
 /*
  * Return the absolute path to a file from a path that may
- * be absolute or relative
+ * be absolute or relative, whether or not it exists
  */
 std::string fileCanonicalize( std::string path );
 
+/*
+ * Whether fileCanonicalize resolves symlinks. Without, paths are only
+ * tidied up as written, which takes no system calls, but a file reached
+ * through a symlink has a name of its own.
+ */
+void fileResolveSymlinks( bool resolve );
+
 #endif /* __FILE_H__ */
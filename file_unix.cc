@@ -5,10 +5,12 @@
 #include <unistd.h>
 #include "file.h"
 #include "exception.h"
+#include "stats.h"
 #include <iostream>
 #include <errno.h>
 #include <string.h>
 #include <string>
+#include <unordered_map>
 
 using namespace std;
 
@@ -16,6 +18,7 @@ int fileTime(const string &file, time_t *time, bool *isDir)
 {
     struct stat s;
 
+    stats_add( STAT_STAT );
     if( stat( file.c_str(), &s ) ) {
         return -1;
     }
@@ -29,6 +32,7 @@ int fileTime(const string &file, time_t *time)
 {
     struct stat s;
 
+    stats_add( STAT_STAT );
     if( stat( file.c_str(), &s ) ) {
         return -1;
     }
@@ -49,12 +53,12 @@ int fileTimeEarliest(const list<string> &files, time_t *time)
 
     i = files.begin();
 
-    if( !fileTime( *i, &earliest ) ) {
+    if( fileTime( *i, &earliest ) ) {
         return -1;
     }
 
     while( i != files.end() ) {
-        if( !fileTime( *i, &t ) ) {
+        if( fileTime( *i, &t ) ) {
             return -1;
         }
         if( t < earliest ) earliest = t;
@@ -74,97 +78,122 @@ bool fileExists(const string &file)
 {
     struct stat s;
 
+    stats_add( STAT_STAT );
     return !stat( file.c_str(), &s );
 }
 
-#if 1
-// Realpath seems to be incredibly slow (on linux, x86)
-// I guess it's because of resolving symlinks? I don't care TOO much about
-// symlinks (though it would be cool to support them, but we can't support
-// hardlinks anyway, and probably not mount points, so probably not worth it)
-// so I'd like to replace them with the custom code below that doesn't handle
-// symlinks once that code is working
-string fileCanonicalize( string path )
+bool fileIsRegular(const string &file)
+{
+    struct stat s;
+
+    stats_add( STAT_STAT );
+    return !stat( file.c_str(), &s ) && S_ISREG(s.st_mode);
+}
+
+// The directory we're building in, which getcwd gives without symlinks
+static const string &working_directory( )
 {
+    static string cwd;
     char buf[ PATH_MAX ];
-    char *ret;
 
-    ret = realpath( path.c_str(), buf );
+    if( cwd.empty() && getcwd( buf, PATH_MAX ) != NULL ) {
+        cwd = buf;
+    }
+    return cwd;
+}
 
-    if( ret == NULL ) {
-        if( errno == ENOENT ) {
-            // File was not found, so canonicalization doesn't really matter
-            return path;
-        } else {
-            throw runtime_wexception( string( "Error canonicalizing path '" ) + path + string("'") );
-        }
+// As many as Linux follows in one lookup before giving up with ELOOP
+static const unsigned int maxSymlinks = 40;
+static bool resolveSymlinks = true;
+
+// What lstat found at each path looked at so far: the target of a symlink,
+// or nothing for anything else. Only paths that exist are kept, as a
+// missing one may yet be created, so each prefix is looked at once.
+static unordered_map<string, string> linkTargets;
+
+void fileResolveSymlinks( bool resolve )
+{
+    resolveSymlinks = resolve;
+}
+
+// Whether a path is a symlink, and where to. Sets *missing if it doesn't
+// exist, or a component of it isn't a directory.
+static bool read_link( const string &path, string *target, bool *missing )
+{
+    unordered_map<string, string>::iterator i;
+    char buf[ PATH_MAX ];
+    struct stat s;
+    ssize_t length;
+
+    i = linkTargets.find( path );
+    if( i != linkTargets.end() ) {
+        *target = i->second;
+        return !target->empty();
     }
-    return buf;
+
+    stats_add( STAT_STAT );
+    if( lstat( path.c_str(), &s ) ) {
+        *missing = true;
+        return false;
+    }
+    target->clear();
+    if( S_ISLNK( s.st_mode ) ) {
+        length = readlink( path.c_str(), buf, sizeof(buf) );
+        if( length > 0 ) target->assign( buf, length );
+    }
+    linkTargets[ path ] = *target;
+    return !target->empty();
 }
-#else
+
+// Worked out a component at a time, as realpath does, but without a system
+// call for a prefix that's been seen before. ".." takes off the last
+// component once any symlink to it has been followed. From the first
+// component that doesn't exist, the rest is taken as written.
 string fileCanonicalize( string path )
 {
-    int i, length, start=0;
-    char buf[ PATH_MAX ];
-    string ret;
-    enum {
-        COPY,
-        DOT,
-        DOTDOT
-    } state=COPY;
-
-    if( path.length() == 0 ) return path;
-
-    // See if the path is absolute
-    if( path[0] != '/' ) {
-        ret = string( getcwd( buf, PATH_MAX ) ) + "/";
+    string resolved, target;
+    size_t start, end, length;
+    unsigned int links = 0;
+    bool lexical = !resolveSymlinks;
+    StatsTimer timer( STAT_CANONICALIZE_TIME );
+
+    stats_add( STAT_CANONICALIZE );
+    if( path.empty() ) return path;
+
+    // Kept without a trailing slash, so the root is empty
+    if( path[ 0 ] != '/' ) {
+        resolved = working_directory();
+        if( resolved == "/" ) resolved.clear();
     }
 
-    length = path.length();
-    for(i = 0; i < length; i ++ ) {
-        switch( path[ i ] ) {
-            case '.':
-                switch( state ) {
-                    case COPY:
-                        state = DOT;
-                        break;
-                    case DOT:
-                        state = DOTDOT;
-                        break;
-                    case DOTDOT:
-                        state = COPY;
-                        break;
-                }
-                break;
-            case '/':
-                switch( state ) {
-                    case COPY:
-                        // Just keep copying
-                        break;
-                    case DOT:
-                        // We have a dot, just remove it
-                        cout << ". with " << ret << start << "," << i-2 << ")" << endl;
-                        ret += path.substr( start, i-2 );
-                        cout << "Killing " << ret << " for ." << endl;
-                        start = i;
-                        state = COPY;
-                        break;
-                    case DOTDOT:
-                        // We have a dotdot, copy over, then remove the last thing before it
-                        cout << ".. with " << ret << "(" << start << "," << i-3 << ")" << endl;
-                        ret += path.substr( start, i-3 );
-                        cout << "Killing with " << ret << endl;
-                        ret.erase(ret.find_last_of('/'));
-                        start = i;
-                        state = COPY;
-                        break;
-                }
-            default:
-                // Keep copying
-                break;
+    for( start = 0; start < path.length(); start = end + 1 ) {
+        end = path.find( '/', start );
+        if( end == string::npos ) end = path.length();
+        if( end == start || (end == start + 1 && path[ start ] == '.') ) continue;
+        if( end == start + 2 && path[ start ] == '.' && path[ start + 1 ] == '.' ) {
+            length = resolved.find_last_of( '/' );
+            if( length != string::npos ) resolved.erase( length );
+            continue;
+        }
+
+        length = resolved.length();
+        resolved += '/';
+        resolved.append( path, start, end - start );
+        if( lexical || !read_link( resolved, &target, &lexical ) ) continue;
+
+        // Carry on from the start of the target, with what's left of the
+        // path after it
+        if( ++ links > maxSymlinks ) {
+            throw runtime_wexception( string( "Too many symlinks canonicalizing path '" ) + path + string("'") );
+        }
+        path = target + path.substr( end );
+        end = (size_t)-1;
+        if( target[ 0 ] == '/' ) {
+            resolved.clear();
+        } else {
+            resolved.erase( length );
         }
     }
-    
-    return ret + path.substr( start );
+
+    return resolved.empty() ? "/" : resolved;
 }
-#endif
@@ -22,7 +22,12 @@ OUTPUT=-o
 
 libptmake.so : CXXFLAGS += -fPIC
 libptmake.so : $(OBJS)
-	$(LD) -shared -Wl,-soname,libptmake.so `libgcrypt-config --cflags --libs` -ldb -o $@ $^
+	$(LD) -shared -Wl,-soname,libptmake.so `libgcrypt-config --cflags --libs` -ldb -ldl -lpthread -o $@ $^
+
+# Loaded into traced commands, so it's plain C with no dependencies
+all : libptmake_preload.so
+libptmake_preload.so : preload.c preload.h
+	gcc -shared -fPIC $(CPPFLAGS) -Wl,-soname,libptmake_preload.so -o $@ preload.c -ldl -lpthread
 
 # Look for the library in the current directory for a debug build, so we don't
 # need to install it all the time
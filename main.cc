@@ -1,11 +1,16 @@
 #include <exception>
 #include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
 #include "find.h"
+#include "file.h"
 #include "parse.h"
 #include "argpc.h"
 #include "build.h"
 #include "plotter.h"
 #include "debug.h"
+#include "subprocess.h"
+#include "stats.h"
 #include "dependencies.h"
 
 using namespace std;
@@ -31,6 +36,37 @@ void plot( std::string file )
     plotfile = file;
 }
 
+void one_shell( )
+{
+    set_one_shell( true );
+}
+
+void use_depfiles( )
+{
+    set_use_depfiles( true );
+}
+
+void trust( std::string option )
+{
+    unsigned int runs = 0, every = 10;
+
+    if( sscanf( option.c_str(), "%u,%u", &runs, &every ) < 1 ) {
+        cerr << "Invalid trust setting: " << option << endl;
+        exit( 1 );
+    }
+    set_trust( runs, every );
+}
+
+void system_prefix( std::string prefix )
+{
+    add_system_prefix( prefix );
+}
+
+void no_symlinks( )
+{
+    fileResolveSymlinks( false );
+}
+
 int main(int argc, char *argv[])
 {
     Plotter p;
@@ -50,10 +86,18 @@ int main(int argc, char *argv[])
         options->addOption( ArgpcOption( "file", 'f', "file", "Read FILE as a makefile.", set_makefile ) );
         options->addOption( ArgpcOption( "depfile", 'b', "depfile", "Use specified file as dependency database.", set_depfile ) );
         options->addOption( ArgpcOption( "plot", 'p', "graphfile", "Draw the cached dependency information", plot ) );
+        options->addOption( ArgpcOption( "one-shell", 'o', "Run all the commands of a rule in one shell, stopping at the first that fails. Directory changes and variables carry over between commands.", one_shell ) );
+        options->addOption( ArgpcOption( "depfiles", 'M', "Don't trace compilers run with -MD or -MMD. Their dependencies are read from the files they write instead, which is much cheaper, but files they include can't be built on demand.", use_depfiles ) );
+        options->addOption( ArgpcOption( "trust", 'T', "runs[,every]", "Once RUNS builds of a target in a row have traced the same dependencies, run its commands untraced and keep them. It's traced again on every EVERY-th build (10 by default), and whenever one of its dependencies is created or deleted.", trust ) );
+        options->addOption( ArgpcOption( "system", 's', "prefix", "Treat paths starting with PREFIX as part of the toolchain, checked once per build rather than for each rule. /usr, /lib, /bin, /sbin and /etc are always included. May be given more than once.", system_prefix ) );
+        options->addOption( ArgpcOption( "no-symlinks", 'L', "Don't resolve symlinks when working out which file a path names. Paths are only tidied up as written, which is faster, but a file reached through a symlink is taken to be a different file.", no_symlinks ) );
 
         debug_init( );
+        stats_init( );
+        subprocess_init( );
 
         options->parse( &argc, argv );
+        subprocess_start( );
 
         dependencies_init();
 
@@ -44,7 +44,7 @@ string MakeMatch::substitute(const string &input)
         } else {
             stringstream ss;
             string s;
-            ss << string( input, 0, wildcard_i ) << target.substr( wildcard_t, target.length() - length ) << string( input, wildcard_i+1, string::npos );
+            ss << string( input, 0, wildcard_i ) << target.substr( wildcard_t, target.length() - length - wildcard_t ) << string( input, wildcard_i+1, string::npos );
             return ss.str();
         }
     } else {
@@ -9,11 +9,13 @@
 #include <sstream>
 #include <utility>
 #include "make_rules.h"
+#include "subprocess.h"
 int yylex(void);
 void yyerror(const char *s);
 void print_rule( void *);
 void * make_rule( void *, void *);
 void * make_rule_header( void *, void *);
+void make_assignment( void *, void *);
 void * make_dependencies( void *, void *);
 void * new_stringlist();
 void * add_stringlist( void *, void *);
@@ -35,17 +37,25 @@ static FILE *f;
 
 %%
 
-program: END
-	| statement program
+program: statements END
+	;
+
+statements:
+	| statements statement
 	;
 
 statement:
 	blankline
 	| rule  					{ }
+	| assignment
 
 blankline:
 	'\n'
 
+assignment:
+	targetlist '=' sourcelist '\n'	{ make_assignment( $1, $3 ); }
+	;
+
 rule:
 	ruleheader rulebody			{ $$ = make_rule($1, $2); }
 	;
@@ -75,7 +85,7 @@ sourcelist:						{ $$ = new_stringlist(); }
 %%
 bool isSpecial(char c)
 {
-	return strchr( "|:\n\t", c ) != NULL;
+	return strchr( "|:=\n\t", c ) != NULL;
 }
 
 bool isidchar(char c)
@@ -218,6 +228,36 @@ void * make_rule_header( void *targets, void *dependencies)
 	return r;
 }
 
+// Only special variables are supported, and each assignment adds to them
+void make_assignment( void *names, void *values)
+{
+	std::list<std::string> *n = (std::list<std::string> *)names;
+	std::list<std::string> *v = (std::list<std::string> *)values;
+	std::list<std::string>::iterator i;
+	std::string name;
+
+	// The lexer splits "+=" either side of the name
+	if( !n->empty() && n->back() == "+" ) n->pop_back();
+	if( n->size() != 1 ) {
+		throw std::runtime_error( "Parse error" );
+	}
+	name = n->front();
+	if( name.length() > 1 && name[ name.length() - 1 ] == '+' ) {
+		name.erase( name.length() - 1 );
+	}
+
+	if( name == ".PTMAKE_EXCLUDE" ) {
+		for( i = v->begin(); i != v->end(); i ++ ) {
+			Subprocess::addExclusion( *i );
+		}
+	} else {
+		throw std::runtime_error( "Unsupported variable " + name );
+	}
+
+	delete n;
+	delete v;
+}
+
 void * make_dependencies( void *main, void *orderOnly)
 {
 	// Early out when we don't need to construct anything
@@ -18,7 +18,7 @@ bool MakeRule::match(const string &target, Match **match)
     b = targets->begin();
     e = targets->end();
     for( te = b; te != e; te ++ ) {
-        if( makeMatch->initialize(target, *te) ) {
+        if( makeMatch->initialize(target, ruleName( *te )) ) {
             *match = makeMatch;
             return true;
         }
@@ -30,9 +30,21 @@ bool MakeRule::match(const string &target, Match **match)
 
 string MakeRule::expand_command( const string &command, const string &target, Match *m )
 {
-    string ret = command;
+    string ret = command, written = target;
     size_t position = 0;
 
+    // The target as the makefile names it, like the dependencies
+    if( targets != NULL && command.find( "$@" ) != string::npos ) {
+        for( list<string>::iterator te = targets->begin(); te != targets->end(); te ++ ) {
+            MakeMatch makeMatch;
+
+            if( makeMatch.initialize( target, ruleName( *te ) ) ) {
+                written = makeMatch.substitute( *te );
+                break;
+            }
+        }
+    }
+
     while( true ) {
         position = ret.find('$', position);
         if( position == std::string::npos ) break;
@@ -44,8 +56,8 @@ string MakeRule::expand_command( const string &command, const string &target, Ma
         switch( ret[ position + 1 ] ) {
             case '@':
                 // Substitute targets
-                ret = ret.replace(position, 2, target);
-                position += target.length();
+                ret = ret.replace(position, 2, written);
+                position += written.length();
                 break;
             case '<':
                 // Substitute first dependency
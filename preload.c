@@ -0,0 +1,564 @@
+/*
+ * libptmake_preload.so - interposes the libc calls that look up files, and
+ * reports the paths to ptmake. This is much cheaper than stopping the process
+ * with ptrace for every access. See preload.h for the protocol.
+ *
+ * Paths the process creates, writes or removes are reported too, so they can
+ * be left out of its dependencies.
+ *
+ * Calls libc makes internally, and the dynamic loader's own accesses, are not
+ * seen here; so a file made by mkstemp or tmpfile isn't reported as written.
+ * Exec calls are traced by ptmake itself.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "preload.h"
+
+/* These are declared in sys/stat.h, which older glibc versions fill with
+ * inline wrappers that get in the way of defining them here */
+struct stat;
+struct stat64;
+struct statx;
+
+#define WRITE_OPEN (O_CREAT | O_WRONLY | O_TRUNC)
+
+/* Paths already reported by this process, so each one costs a round trip
+ * to ptmake only once. Stored as 64 bit hashes in an open addressed table. */
+#define SEEN_SIZE 8192
+static uint64_t seen[ SEEN_SIZE ];
+static unsigned int seenCount;
+
+static int sock = -1;
+static pid_t sockPid;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int busy;
+
+static ssize_t (*real_readlink)( const char *, char *, size_t );
+
+static void lock_prepare( void )
+{
+    pthread_mutex_lock( &lock );
+}
+
+static void lock_release( void )
+{
+    pthread_mutex_unlock( &lock );
+}
+
+/* Don't let a fork while another thread is talking to ptmake leave the lock
+ * held in the child */
+__attribute__((constructor)) static void preload_init( void )
+{
+    pthread_atfork( lock_prepare, lock_release, lock_release );
+}
+
+struct access
+{
+    char path[ PATH_MAX ];
+    /* Where the path as the program gave it starts in path */
+    size_t relative;
+    int traced;
+};
+
+static uint64_t hash_path( const char *path )
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while( *path ) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+/* Returns true if the path was already in the table */
+static int seen_insert( uint64_t h )
+{
+    unsigned int i = h % SEEN_SIZE;
+
+    while( seen[ i ] ) {
+        if( seen[ i ] == h ) return 1;
+        i = (i + 1) % SEEN_SIZE;
+    }
+    /* Stop remembering once the table is mostly full */
+    if( seenCount < SEEN_SIZE / 2 ) {
+        seen[ i ] = h;
+        seenCount ++;
+    }
+    return 0;
+}
+
+/* Connect to ptmake. A forked child shares its parent's connection, so it
+ * opens its own the first time it reports something. */
+static int connect_ptmake( void )
+{
+    struct sockaddr_un addr;
+    const char *name;
+    socklen_t length;
+
+    if( sock >= 0 && sockPid == getpid() ) return sock;
+    if( sock >= 0 ) close( sock );
+    sock = -1;
+    sockPid = getpid();
+
+    name = getenv( PRELOAD_SOCKET_ENV );
+    if( name == NULL || strlen( name ) + 1 >= sizeof(addr.sun_path) ) return -1;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    /* Abstract namespace: leading NUL, no filesystem entry */
+    strcpy( addr.sun_path + 1, name );
+    length = offsetof(struct sockaddr_un, sun_path) + 1 + strlen( name );
+
+    sock = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( sock < 0 ) return -1;
+    if( connect( sock, (struct sockaddr *)&addr, length ) ) {
+        close( sock );
+        sock = -1;
+    }
+    return sock;
+}
+
+static int send_all( int fd, const char *buf, size_t length )
+{
+    ssize_t n;
+
+    while( length > 0 ) {
+        n = send( fd, buf, length, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return -1;
+        buf += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void send_record( struct access *a, int type, int exists )
+{
+    char buf[ sizeof(struct preload_record) + PATH_MAX ];
+    struct preload_record *r = (struct preload_record *)buf;
+    char ack;
+    int fd;
+
+    r->length = strlen( a->path );
+    r->type = type;
+    r->exists = exists;
+    r->relative = a->relative;
+    memcpy( buf + sizeof(*r), a->path, r->length );
+
+    pthread_mutex_lock( &lock );
+    fd = connect_ptmake();
+    if( fd >= 0 && !send_all( fd, buf, sizeof(*r) + r->length ) && type == PRELOAD_ENTRY ) {
+        while( recv( fd, &ack, 1, 0 ) < 0 && errno == EINTR );
+    }
+    pthread_mutex_unlock( &lock );
+}
+
+/* Make a path absolute, without asking the kernel to resolve anything but
+ * the current directory or a directory fd */
+static int make_absolute( int dirfd, const char *path, struct access *a )
+{
+    char link[ 64 ];
+    ssize_t length;
+
+    a->relative = 0;
+    if( path[ 0 ] == '/' ) {
+        if( strlen( path ) >= PATH_MAX ) return -1;
+        strcpy( a->path, path );
+        return 0;
+    }
+
+    if( dirfd == AT_FDCWD ) {
+        if( getcwd( a->path, PATH_MAX ) == NULL ) return -1;
+        length = strlen( a->path );
+        a->relative = length + 1;
+    } else {
+        if( real_readlink == NULL ) real_readlink = dlsym( RTLD_NEXT, "readlink" );
+        snprintf( link, sizeof(link), "/proc/self/fd/%d", dirfd );
+        length = real_readlink( link, a->path, PATH_MAX - 1 );
+        if( length <= 0 ) return -1;
+    }
+
+    if( length + 1 + strlen( path ) >= PATH_MAX ) return -1;
+    a->path[ length ] = '/';
+    strcpy( a->path + length + 1, path );
+    return 0;
+}
+
+/* Called before a libc call that reads a path. Tells ptmake about it, unless
+ * it has already been reported, and waits until ptmake says to go ahead. */
+static void entry( struct access *a, int dirfd, const char *path, int reading )
+{
+    int saved = errno;
+
+    a->traced = 0;
+    if( busy || !reading || path == NULL || path[ 0 ] == 0 ) return;
+    busy = 1;
+
+    if( !make_absolute( dirfd, path, a ) ) {
+        pthread_mutex_lock( &lock );
+        a->traced = !seen_insert( hash_path( a->path ) );
+        pthread_mutex_unlock( &lock );
+        if( a->traced ) send_record( a, PRELOAD_ENTRY, 0 );
+    }
+
+    busy = 0;
+    errno = saved;
+}
+
+/* Called after the libc call, with whether the path turned out to exist */
+static void leave( struct access *a, int exists )
+{
+    int saved = errno;
+
+    if( a->traced ) {
+        busy = 1;
+        send_record( a, PRELOAD_EXIT, exists );
+        busy = 0;
+    }
+    errno = saved;
+}
+
+/* Called after a libc call that created, wrote or removed a path. These
+ * aren't answered, so cost no round trip. */
+static void written( int dirfd, const char *path, int type )
+{
+    struct access a;
+    int saved = errno;
+
+    if( busy || path == NULL || path[ 0 ] == 0 ) return;
+    busy = 1;
+    if( !make_absolute( dirfd, path, &a ) ) send_record( &a, type, 0 );
+    busy = 0;
+    errno = saved;
+}
+
+#define REAL(name) \
+    static __typeof__(name) *real; \
+    if( real == NULL ) real = (__typeof__(name) *)dlsym( RTLD_NEXT, #name )
+
+#define OPEN_MODE(flags, mode) \
+    if( flags & (O_CREAT | O_TMPFILE) ) { \
+        va_list ap; \
+        va_start( ap, flags ); \
+        mode = va_arg( ap, int ); \
+        va_end( ap ); \
+    }
+
+/* Wrap a call whose result is an int that's negative on failure */
+#define TRACE_CALL(dirfd, path, reading, call) \
+    struct access a; \
+    int ret; \
+    entry( &a, dirfd, path, reading ); \
+    ret = call; \
+    leave( &a, ret >= 0 ); \
+    return ret
+
+/* The same for the open family, which either reads or writes the path */
+#define OPEN_CALL(dirfd, path, flags, call) \
+    struct access a; \
+    int ret; \
+    entry( &a, dirfd, path, !(flags & WRITE_OPEN) ); \
+    ret = call; \
+    leave( &a, ret >= 0 ); \
+    if( ret >= 0 && (flags & WRITE_OPEN) ) written( dirfd, path, PRELOAD_WRITE ); \
+    return ret
+
+/* And for calls that create or remove the path without reading it */
+#define WRITE_CALL(dirfd, path, type, call) \
+    int ret = call; \
+    if( ret >= 0 ) written( dirfd, path, type ); \
+    return ret
+
+int open( const char *path, int flags, ... )
+{
+    int mode = 0;
+    REAL(open);
+    OPEN_MODE(flags, mode);
+    OPEN_CALL( AT_FDCWD, path, flags, real( path, flags, mode ) );
+}
+
+int open64( const char *path, int flags, ... )
+{
+    int mode = 0;
+    REAL(open64);
+    OPEN_MODE(flags, mode);
+    OPEN_CALL( AT_FDCWD, path, flags, real( path, flags, mode ) );
+}
+
+int __open_2( const char *path, int flags )
+{
+    REAL(__open_2);
+    OPEN_CALL( AT_FDCWD, path, flags, real( path, flags ) );
+}
+
+int __open64_2( const char *path, int flags )
+{
+    REAL(__open64_2);
+    OPEN_CALL( AT_FDCWD, path, flags, real( path, flags ) );
+}
+
+int openat( int dirfd, const char *path, int flags, ... )
+{
+    int mode = 0;
+    REAL(openat);
+    OPEN_MODE(flags, mode);
+    OPEN_CALL( dirfd, path, flags, real( dirfd, path, flags, mode ) );
+}
+
+int openat64( int dirfd, const char *path, int flags, ... )
+{
+    int mode = 0;
+    REAL(openat64);
+    OPEN_MODE(flags, mode);
+    OPEN_CALL( dirfd, path, flags, real( dirfd, path, flags, mode ) );
+}
+
+int __openat_2( int dirfd, const char *path, int flags )
+{
+    REAL(__openat_2);
+    OPEN_CALL( dirfd, path, flags, real( dirfd, path, flags ) );
+}
+
+int __openat64_2( int dirfd, const char *path, int flags )
+{
+    REAL(__openat64_2);
+    OPEN_CALL( dirfd, path, flags, real( dirfd, path, flags ) );
+}
+
+/* fopen opens files with libc's internal open, which can't be interposed */
+static int fopen_reads( const char *mode )
+{
+    return mode != NULL && mode[ 0 ] == 'r' && strchr( mode, '+' ) == NULL;
+}
+
+FILE *fopen( const char *path, const char *mode )
+{
+    struct access a;
+    FILE *ret;
+    REAL(fopen);
+
+    entry( &a, AT_FDCWD, path, fopen_reads( mode ) );
+    ret = real( path, mode );
+    leave( &a, ret != NULL );
+    if( ret != NULL && !fopen_reads( mode ) ) written( AT_FDCWD, path, PRELOAD_WRITE );
+    return ret;
+}
+
+FILE *fopen64( const char *path, const char *mode )
+{
+    struct access a;
+    FILE *ret;
+    REAL(fopen64);
+
+    entry( &a, AT_FDCWD, path, fopen_reads( mode ) );
+    ret = real( path, mode );
+    leave( &a, ret != NULL );
+    if( ret != NULL && !fopen_reads( mode ) ) written( AT_FDCWD, path, PRELOAD_WRITE );
+    return ret;
+}
+
+int creat( const char *path, mode_t mode )
+{
+    REAL(creat);
+    WRITE_CALL( AT_FDCWD, path, PRELOAD_WRITE, real( path, mode ) );
+}
+
+int creat64( const char *path, mode_t mode )
+{
+    REAL(creat64);
+    WRITE_CALL( AT_FDCWD, path, PRELOAD_WRITE, real( path, mode ) );
+}
+
+int unlink( const char *path )
+{
+    REAL(unlink);
+    WRITE_CALL( AT_FDCWD, path, PRELOAD_REMOVE, real( path ) );
+}
+
+int unlinkat( int dirfd, const char *path, int flags )
+{
+    REAL(unlinkat);
+    WRITE_CALL( dirfd, path, PRELOAD_REMOVE, real( dirfd, path, flags ) );
+}
+
+int remove( const char *path )
+{
+    REAL(remove);
+    WRITE_CALL( AT_FDCWD, path, PRELOAD_REMOVE, real( path ) );
+}
+
+/* The old path is gone and the new one written. renameat2 is left to the
+ * system call tracing, as older libcs don't have it. */
+int rename( const char *oldpath, const char *newpath )
+{
+    int ret;
+    REAL(rename);
+
+    ret = real( oldpath, newpath );
+    if( ret >= 0 ) {
+        written( AT_FDCWD, oldpath, PRELOAD_REMOVE );
+        written( AT_FDCWD, newpath, PRELOAD_WRITE );
+    }
+    return ret;
+}
+
+int renameat( int olddirfd, const char *oldpath, int newdirfd, const char *newpath )
+{
+    int ret;
+    REAL(renameat);
+
+    ret = real( olddirfd, oldpath, newdirfd, newpath );
+    if( ret >= 0 ) {
+        written( olddirfd, oldpath, PRELOAD_REMOVE );
+        written( newdirfd, newpath, PRELOAD_WRITE );
+    }
+    return ret;
+}
+
+DIR *opendir( const char *path )
+{
+    struct access a;
+    DIR *ret;
+    REAL(opendir);
+
+    entry( &a, AT_FDCWD, path, 1 );
+    ret = real( path );
+    leave( &a, ret != NULL );
+    return ret;
+}
+
+int stat( const char *path, struct stat *buf )
+{
+    REAL(stat);
+    TRACE_CALL( AT_FDCWD, path, 1, real( path, buf ) );
+}
+
+int stat64( const char *path, struct stat64 *buf )
+{
+    REAL(stat64);
+    TRACE_CALL( AT_FDCWD, path, 1, real( path, buf ) );
+}
+
+int lstat( const char *path, struct stat *buf )
+{
+    REAL(lstat);
+    TRACE_CALL( AT_FDCWD, path, 1, real( path, buf ) );
+}
+
+int lstat64( const char *path, struct stat64 *buf )
+{
+    REAL(lstat64);
+    TRACE_CALL( AT_FDCWD, path, 1, real( path, buf ) );
+}
+
+int fstatat( int dirfd, const char *path, struct stat *buf, int flags )
+{
+    REAL(fstatat);
+    TRACE_CALL( dirfd, path, 1, real( dirfd, path, buf, flags ) );
+}
+
+int fstatat64( int dirfd, const char *path, struct stat64 *buf, int flags )
+{
+    REAL(fstatat64);
+    TRACE_CALL( dirfd, path, 1, real( dirfd, path, buf, flags ) );
+}
+
+/* glibc before 2.33 exports the stat family under these names */
+int __xstat( int ver, const char *path, struct stat *buf )
+{
+    REAL(__xstat);
+    TRACE_CALL( AT_FDCWD, path, 1, real( ver, path, buf ) );
+}
+
+int __xstat64( int ver, const char *path, struct stat64 *buf )
+{
+    REAL(__xstat64);
+    TRACE_CALL( AT_FDCWD, path, 1, real( ver, path, buf ) );
+}
+
+int __lxstat( int ver, const char *path, struct stat *buf )
+{
+    REAL(__lxstat);
+    TRACE_CALL( AT_FDCWD, path, 1, real( ver, path, buf ) );
+}
+
+int __lxstat64( int ver, const char *path, struct stat64 *buf )
+{
+    REAL(__lxstat64);
+    TRACE_CALL( AT_FDCWD, path, 1, real( ver, path, buf ) );
+}
+
+int __fxstatat( int ver, int dirfd, const char *path, struct stat *buf, int flags )
+{
+    REAL(__fxstatat);
+    TRACE_CALL( dirfd, path, 1, real( ver, dirfd, path, buf, flags ) );
+}
+
+int __fxstatat64( int ver, int dirfd, const char *path, struct stat64 *buf, int flags )
+{
+    REAL(__fxstatat64);
+    TRACE_CALL( dirfd, path, 1, real( ver, dirfd, path, buf, flags ) );
+}
+
+int statx( int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf )
+{
+    REAL(statx);
+    TRACE_CALL( dirfd, path, 1, real( dirfd, path, flags, mask, buf ) );
+}
+
+int access( const char *path, int mode )
+{
+    REAL(access);
+    TRACE_CALL( AT_FDCWD, path, mode != W_OK, real( path, mode ) );
+}
+
+int faccessat( int dirfd, const char *path, int mode, int flags )
+{
+    REAL(faccessat);
+    TRACE_CALL( dirfd, path, mode != W_OK, real( dirfd, path, mode, flags ) );
+}
+
+int euidaccess( const char *path, int mode )
+{
+    REAL(euidaccess);
+    TRACE_CALL( AT_FDCWD, path, mode != W_OK, real( path, mode ) );
+}
+
+/* readlink fails with EINVAL on a file that exists but isn't a link */
+ssize_t readlink( const char *path, char *buf, size_t size )
+{
+    struct access a;
+    ssize_t ret;
+
+    if( real_readlink == NULL ) real_readlink = dlsym( RTLD_NEXT, "readlink" );
+    entry( &a, AT_FDCWD, path, 1 );
+    ret = real_readlink( path, buf, size );
+    leave( &a, ret >= 0 || (errno != ENOENT && errno != ENOTDIR) );
+    return ret;
+}
+
+ssize_t readlinkat( int dirfd, const char *path, char *buf, size_t size )
+{
+    struct access a;
+    ssize_t ret;
+    REAL(readlinkat);
+
+    entry( &a, dirfd, path, 1 );
+    ret = real( dirfd, path, buf, size );
+    leave( &a, ret >= 0 || (errno != ENOENT && errno != ENOTDIR) );
+    return ret;
+}
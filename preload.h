@@ -0,0 +1,40 @@
+#ifndef __PRELOAD_H__
+#define __PRELOAD_H__
+
+#include <stdint.h>
+
+/*
+ * Protocol between libptmake_preload.so, which is loaded into traced commands
+ * with LD_PRELOAD, and ptmake.
+ *
+ * Each process connects to the unix socket named in PTMAKE_SOCKET (in the
+ * abstract namespace) and sends a preload_record followed by the path it is
+ * accessing. ptmake answers each PRELOAD_ENTRY record with a single byte once
+ * it has finished with it (possibly after building the file), and the process
+ * waits for that before going on with the access.
+ *
+ * Paths the process has created, written or removed are sent afterwards as
+ * PRELOAD_WRITE and PRELOAD_REMOVE records, which aren't answered.
+ *
+ * Paths are absolute. If the program gave one relative to the current
+ * directory, relative is the offset where its own part starts.
+ */
+#define PRELOAD_SOCKET_ENV "PTMAKE_SOCKET"
+#define PRELOAD_LIBRARY "libptmake_preload.so"
+
+enum {
+    PRELOAD_ENTRY = 1,
+    PRELOAD_EXIT = 2,
+    PRELOAD_WRITE = 3,
+    PRELOAD_REMOVE = 4
+};
+
+struct preload_record
+{
+    uint32_t length;
+    uint8_t type;
+    uint8_t exists;
+    uint16_t relative;
+};
+
+#endif /* __PRELOAD_H__ */
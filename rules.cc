@@ -2,6 +2,7 @@
 #include <list>
 #include <iostream>
 #include <algorithm>
+#include <sstream>
 #include <gcrypt.h>
 #include "file.h"
 #include "rules.h"
@@ -11,6 +12,9 @@
 #include "exception.h"
 #include "subprocess.h"
 #include "dependencies.h"
+#include "utilities.h"
+#include "depfile.h"
+#include "stats.h"
 
 using namespace std;
 
@@ -23,6 +27,57 @@ list<Rule *> Rule::rules;
 std::set<std::string> Rule::buildCache;
 
 Plotter *Rule::plotter = NULL;
+bool Rule::oneShell = false;
+bool Rule::useDepfiles = false;
+unsigned int Rule::trustRuns = 0;
+unsigned int Rule::trustEvery = 0;
+
+// Canonical names of the paths commands have looked up, for the whole build
+std::unordered_map<std::string, std::string> Rule::canonicalCache;
+std::unordered_map<std::string, std::string> Rule::producers;
+// And of the names the rules give, which are kept as written
+std::unordered_map<std::string, std::string> Rule::ruleNames;
+// The rules by the last component of each of their targets, or what follows
+// its wildcard
+std::unordered_map<std::string, std::list<Rule *> > Rule::byName;
+std::map<std::string, std::list<Rule *> > Rule::bySuffix;
+bool Rule::indexed = false;
+unsigned long Rule::canonicalHits = 0;
+
+// Jobs still running, or waiting to
+std::map<std::string, Job *> Job::active;
+std::map<std::string, std::pair<bool, time_t> > Job::fingerprints;
+
+// Where the compilers, libraries and system headers live
+static const char *defaultSystemPrefixes[] = {
+    "/usr/", "/lib/", "/lib32/", "/lib64/", "/bin/", "/sbin/", "/etc/"
+};
+std::list<std::string> Rule::systemPrefixes( defaultSystemPrefixes,
+    defaultSystemPrefixes + sizeof(defaultSystemPrefixes) / sizeof(defaultSystemPrefixes[0]) );
+
+// Dependencies named with this are fingerprints of system paths. The record
+// of the paths is stored under the hash of the name, which is made from the
+// hash of the paths, so rules with the same toolchain share one record.
+#define FINGERPRINT_PREFIX "*toolchain "
+
+// The files a target's commands wrote are recorded under the hash of this
+// followed by the printed hash of the rule, and the target that wrote a file
+// no rule lists under the hash of the other followed by the file's name
+#define OUTPUTS_PREFIX "*outputs "
+#define PRODUCER_PREFIX "*producer "
+
+// How stable a target's dependencies are is recorded under the hash of this
+// followed by the printed hash of the rule, as the hash of the dependencies,
+// the number of traced builds in a row that found them, and the number of
+// untraced builds since, separated by spaces
+#define STABILITY_PREFIX "*stability "
+
+// What has been recorded about a path in seenPaths
+enum {
+    SEEN_ENTRY = 1,
+    SEEN_MISSING = 2,
+    SEEN_EXISTS = 4
+};
 
 Subprocess::~Subprocess( )
 {
@@ -74,40 +129,101 @@ void print(std::string filename, int status)
     cout << "Depends on " << filename << "(" << status << ")" << endl;
 }
 
-void Rule::callback_entry(std::string filename)
+string Rule::canonicalName(const string &path)
 {
-    pair<Rule *, Match *> r;
+    unordered_map<string, string>::iterator i;
+    string canon;
 
-    string canon = fileCanonicalize( filename );
-    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-        ::print(canon);
+    i = canonicalCache.find( path );
+    if( i != canonicalCache.end() ) {
+        canonicalHits ++;
+        stats_add( STAT_CANONICALIZE_CACHED );
+        return i->second;
     }
 
-    r = Rule::find(canon);
-    if( r.first ) {
-        r.first->execute( canon, r.second );
-        dependencies.insert( pair<string,bool>(canon, true) );
+    // Only the part of a missing path that exists has its symlinks
+    // resolved, and what's created later can be a symlink, so only
+    // existing files are cached
+    canon = fileCanonicalize( path );
+    if( fileExists( path ) ) {
+        canonicalCache[ path ] = canon;
     }
+    return canon;
 }
 
-void Rule::callback_exit(std::string filename, bool success)
+// The last component of a name, or if it has a wildcard, what follows that,
+// with partial set
+static string last_name(const string &name, bool *partial)
 {
-    string canon = fileCanonicalize( filename );
-    dependencies.insert( pair<string,bool>(canon, success) );
+    size_t wildcard = name.find( '%' ), end, slash;
 
-    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-        ::print(canon, success);
+    *partial = wildcard != string::npos;
+    if( *partial ) return name.substr( wildcard + 1 );
+    end = name.find_last_not_of( '/' );
+    if( end == string::npos ) return "";
+    slash = name.find_last_of( '/', end );
+    if( slash == string::npos ) return name.substr( 0, end + 1 );
+    return name.substr( slash + 1, end - slash );
+}
+
+string Rule::lastName(const string &name, bool *partial)
+{
+    string last = last_name( name, partial );
+
+    // Only the canonical name says what . and .. lead to, or what follows
+    // a wildcard once it's past a slash
+    if( *partial ? last.find( '/' ) != string::npos : last.empty() || last == "." || last == ".." ) {
+        last = last_name( ruleName( name ), partial );
     }
+    return last;
+}
+
+void Rule::index()
+{
+    list<string>::iterator j;
+    string name;
+    bool partial;
+
+    byName.clear();
+    bySuffix.clear();
+    for( list<Rule *>::iterator i = rules.begin(); i != rules.end(); i ++ ) {
+        if( (*i)->targets == NULL ) continue;
+        for( j = (*i)->targets->begin(); j != (*i)->targets->end(); j ++ ) {
+            name = lastName( *j, &partial );
+            if( partial ) {
+                bySuffix[ name ].push_back( *i );
+            } else {
+                byName[ name ].push_back( *i );
+            }
+        }
+    }
+    indexed = true;
+}
+
+const string &Rule::ruleName(const string &name)
+{
+    unordered_map<string, string>::iterator i;
+
+    i = ruleNames.find( name );
+    if( i != ruleNames.end() ) return i->second;
+
+    // Worked out once, as when the makefile was read, so a name a rule
+    // gives means the same file all through the build
+    string &canon = ruleNames[ name ];
+    canon = fileCanonicalize( name );
+    return canon;
 }
 
 bool Rule::build(const std::string &target, bool *updated)
 {
     pair<Rule *, Match *> r;
+    string canon = fileCanonicalize( target ), builds;
     
-    r = find( fileCanonicalize( target ) );
+    r = find( canon, &builds );
     if( r.first ) {
-        *updated = r.first->execute( target, r.second );
-        delete r.second;
+        // Built by its canonical name, as it is when it's a dependency, or
+        // a file no rule lists by building the target that wrote it
+        *updated = r.first->execute( builds, r.second );
         return true;
     } else {
         // No rule to build the target. But if it exists, that's still okay
@@ -122,120 +238,62 @@ bool Rule::build(const std::string &target, bool *updated)
 
 bool Rule::execute(const string &target, Match *m)
 {
-    unsigned char hash[32];
-    bool needsRebuild = false;
-    list<string>::iterator targeti;
-    list<pair<string, bool> > *deps;
-    time_t targetTime;
-    string targetName;
+    bool updated;
+    Job *job;
 
-    // See if it's already being built
-    if( built( target ) ) return false;
+    job = start( target, m, &updated );
+    if( job == NULL ) return updated;
 
-    // Insert the name in the build cache
-    for(targeti = targets->begin(); targeti != targets->end(); targeti ++ ) {
-        targetName = m->substitute( *targeti );
-        buildCache.insert( targetName );
+    job->hold();
+    while( !job->done && Subprocess::dispatch() );
+    if( !job->done ) {
+        job->release();
+        throw runtime_wexception( "Nothing left to run, but " + target + " is not built" );
     }
+    updated = job->updated;
+    job->release();
+    return updated;
+}
 
-    if( targets == NULL || commands == NULL ) return false;
+Job *Rule::start(const string &target, Match *m, bool *updated)
+{
+    map<string, Job *>::iterator i;
+    list<string>::iterator targeti;
+    Job *job;
 
-    if( fileTime( target, &targetTime ) ) {
-        // No target time, so definitely rebuild
-        targetTime = 0;
-    }
+    *updated = false;
 
-    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-        indent();
-        cout << "Try to build: " << *targets->begin() << "(" << target << "," << targetTime << ")" << endl;
+    // See if it's being built, or already has been
+    i = Job::active.find( target );
+    if( i != Job::active.end() ) {
+        delete m;
+        return i->second;
     }
-    indentation ++;
-
-    recalcHash( target, hash );
-    // See if we have dependencies in the database
-    deps = retrieve_dependencies( hash );
-    // If we know the dependencies, we may be able to avoid building. If we
-    // don't know the dependencies, we definitely have to rebuild.
-    if( deps != NULL ) {
-        // Find which target from the list of targets in the rule is used to build this target
-        // Check for any listed dependencies
-        for( list<pair<string,bool> >::iterator i = declaredDeps->begin(); i != declaredDeps->end(); i ++ ) {
-            string depName;
-            depName = m->substitute( i->first );
-            needsRebuild |= checkDep( target, depName, i->second, targetTime );
-            if( plotter != NULL ) {
-                plotter->output( target, depName );
-            }
-        }
-        // And check for any dependencies we find
-        for( list<pair<string, bool> >::iterator i = deps->begin(); i != deps->end(); i ++ ) {
-            needsRebuild |= checkDep( target, i->first, i->second, targetTime );
-            if( plotter != NULL ) {
-                plotter->output( target, i->first );
-            }
-        }
-        delete deps;
-
-        if( !needsRebuild ) {
-            indentation --;
-            return false;
-        }
-        if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-            cout << "Dependency updated, must build" << endl;
-        }
-    } else {
-        // We don't know the dependencies, have to
-        // build
-        if( get_debug_level( DEBUG_REASON ) ) {
-            cout << "Dependencies unknown, must build \"" << target << "\"" << endl;
-        }
-
-        // Even though we don't know the auto-generated dependencies, there
-        // may be explicit dependencies, so build those
-        for( list<pair<string, bool> >::iterator i = declaredDeps->begin();
-                                    i != declaredDeps->end();
-                                    i ++ ) {
-            string s;
-            time_t t;
-            bool updated;
-            s = m->substitute( i->first );
-            if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-                cout << "Building explicit dependency `" << s << "'" << endl;
-            }
-            if( !fileTime( s, &t ) || t <= targetTime ) {
-                if( !build( s, &updated ) ) {
-                    if( get_debug_level( DEBUG_REASON ) ) {
-                        cout << "Cannot build explicit dep `" << s << "'" << endl;
-                    }
-                    indentation --;
-                    return false;
-                }
-            }
-        }
+    if( built( target ) || targets == NULL ) {
+        delete m;
+        return NULL;
     }
-    
-    clear_dependencies( hash );
-    for(list<string >::iterator i = commands->begin(); i != commands->end(); i ++ ) {
-        trace( expand_command( *i, target, m ) );
 
-        // Touch the targets in case something else updated last in the build process 
-    }
-    add_dependencies( hash, dependencies );
-    dependencies.clear();
-    indentation --;
-    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-        indent();
-        cout << "Done trying to build: " << *targets->begin() << "(" << target << "," << targetTime << ")" << endl;
+    // Insert the name in the build cache
+    for(targeti = targets->begin(); targeti != targets->end(); targeti ++ ) {
+        buildCache.insert( ruleName( m->substitute( *targeti ) ) );
     }
-    if( plotter != NULL ) {
-        for( set<pair<string, bool> >::iterator j = dependencies.begin();
-                                                j != dependencies.end();
-                                                j ++ ) {
-            plotter->output( target, j->first );
-        }
+
+    if( commands == NULL ) {
+        delete m;
+        return NULL;
     }
 
-    return true;
+    job = new Job( this, target, m );
+    job->hold();
+    job->check();
+    if( job->done ) {
+        *updated = job->updated;
+        job->release();
+        return NULL;
+    }
+    job->release();
+    return job;
 }
 
 Rule::Rule( )
@@ -246,13 +304,54 @@ Rule::Rule( )
     commands = NULL;
 }
 
-pair<Rule *,Match *>Rule::find(const string &target)
+pair<Rule *,Match *>Rule::find(const string &target, string *builds)
 {
+    pair<Rule *, Match *> r;
+    string from;
+
+    stats_add( STAT_FIND );
+    r = findListed( target );
+    if( r.first == NULL ) {
+        from = producer( target );
+        if( !from.empty() ) {
+            r = findListed( from );
+            if( r.first != NULL && r.first->hasOutput( from, target ) ) {
+                if( builds != NULL ) *builds = from;
+                return r;
+            }
+            if( r.first != NULL ) delete r.second;
+            r = pair<Rule *, Match *>( NULL, NULL );
+        }
+    }
+
+    if( builds != NULL ) *builds = target;
+    return r;
+}
+
+pair<Rule *,Match *>Rule::findListed(const string &target)
+{
+    unordered_map<string, list<Rule *> >::iterator named;
+    map<string, list<Rule *> >::iterator suffix;
+    set<Rule *> candidates;
+    size_t slash = target.find_last_of( '/' );
     bool depsFound;
     Match *m, *oldm;
     Rule *r = NULL;
-    
-    for(list<Rule *>::iterator i = rules.begin(); i != rules.end(); i ++ )
+
+    // Only the rules with a target named like it, or whose wildcard it can
+    // stand in for, have their targets canonicalized to compare
+    if( !indexed ) index();
+    named = byName.find( target.substr( slash == string::npos ? 0 : slash + 1 ) );
+    if( named != byName.end() ) candidates.insert( named->second.begin(), named->second.end() );
+    for( suffix = bySuffix.begin(); suffix != bySuffix.end(); suffix ++ ) {
+        const string &s = suffix->first;
+        if( target.length() >= s.length() && !target.compare( target.length() - s.length(), s.length(), s ) ) {
+            candidates.insert( suffix->second.begin(), suffix->second.end() );
+        }
+    }
+
+    stats_add( STAT_FIND_SCANNED, candidates.size() );
+    for(set<Rule *>::iterator i = candidates.begin(); i != candidates.end(); i ++ )
     {
         if( (*i)->match( target, &m ) ) {
             if( r ) {
@@ -264,7 +363,7 @@ pair<Rule *,Match *>Rule::find(const string &target)
             // Check that we have all the explicit dependencies, or it's not worth even trying
             depsFound = true;
             for( list<pair<string,bool> >::iterator j = (*i)->declaredDeps->begin(); j != (*i)->declaredDeps->end(); j ++ ) {
-                if( j->second && !canBeBuilt( m->substitute( j->first ) ) ) {
+                if( j->second && !canBeBuilt( ruleName( m->substitute( j->first ) ) ) ) {
                     // Cannot build this file
                     depsFound = false;
                     break;
@@ -282,6 +381,51 @@ pair<Rule *,Match *>Rule::find(const string &target)
     return pair<Rule *, Match *>(r,m);
 }
 
+string Rule::producer(const string &path)
+{
+    unordered_map<string, string>::iterator i;
+    list<pair<string, bool> > *recorded;
+    unsigned char key[32];
+    string name;
+
+    i = producers.find( path );
+    if( i != producers.end() ) return i->second;
+
+    string &from = producers[ path ];
+    if( isSystemPath( path ) ) return from;
+
+    name = PRODUCER_PREFIX + path;
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+    recorded = retrieve_dependencies( key );
+    if( recorded != NULL && !recorded->empty() ) {
+        from = recorded->front().first;
+    }
+    delete recorded;
+    return from;
+}
+
+bool Rule::hasOutput(const string &target, const string &path)
+{
+    list<pair<string, bool> > *outputs;
+    list<pair<string, bool> >::iterator i;
+    unsigned char hash[32], key[32];
+    string name;
+    bool found = false;
+
+    // A change to the rule changes its hash, and what it's known to write
+    recalcHash( target, hash );
+    name = OUTPUTS_PREFIX + printhash( hash );
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+    outputs = retrieve_dependencies( key );
+    if( outputs != NULL ) {
+        for( i = outputs->begin(); i != outputs->end() && !found; i ++ ) {
+            found = i->first == path;
+        }
+    }
+    delete outputs;
+    return found;
+}
+
 bool Rule::match(const std::string &target, Match **match)
 {
     std::list<std::string>::iterator b, e, te;
@@ -293,7 +437,7 @@ bool Rule::match(const std::string &target, Match **match)
     b = targets->begin();
     e = targets->end();
     for( te = b; te != e; te ++ ) {
-        if( *te == target ) {
+        if( ruleName( *te ) == target ) {
             return true;
         }
     }
@@ -316,32 +460,34 @@ bool Rule::canBeBuilt(const std::string &file)
 
 void Rule::addTarget(const std::string &target)
 {
+    indexed = false;
     if( targets == NULL ) {
         targets = new list<string>;
     }
-    targets->push_back(fileCanonicalize(target));
+    targets->push_back(target);
 }
 
 void Rule::addTargetList(std::list<std::string> *targetList)
 {
+    indexed = false;
     if( targets == NULL ) {
         targets = new list<string>;
     }
 
     for( list<string>::iterator i = targetList->begin(); i != targetList->end(); i ++ ) {
-        targets->push_back(fileCanonicalize(*i));
+        targets->push_back(*i);
     }
 }
 
 void Rule::addDependency(const std::string &dependency, bool exists)
 {
-    declaredDeps->push_back(pair<string,bool>(fileCanonicalize(dependency), exists));
+    declaredDeps->push_back(pair<string,bool>(dependency, exists));
 }
 
 void Rule::addDependencyList(list<pair<string,bool> > *dependencyList)
 {
     for( list<pair<string,bool> >::iterator i = dependencyList->begin(); i != dependencyList->end(); i ++ ) {
-        declaredDeps->push_back(pair<string,bool>(fileCanonicalize(i->first),i->second));
+        declaredDeps->push_back(*i);
     }
 }
 
@@ -378,6 +524,40 @@ void Rule::setPlotter( Plotter *p )
     plotter = p;
 }
 
+void Rule::setOneShell( bool oneShell )
+{
+    Rule::oneShell = oneShell;
+}
+
+void Rule::setUseDepfiles( bool useDepfiles )
+{
+    Rule::useDepfiles = useDepfiles;
+}
+
+void Rule::setTrust( unsigned int runs, unsigned int every )
+{
+    trustRuns = runs;
+    trustEvery = every;
+}
+
+void Rule::addSystemPrefix( const string &prefix )
+{
+    if( prefix.empty() ) return;
+    systemPrefixes.push_back( prefix[ prefix.length() - 1 ] == '/' ? prefix : prefix + "/" );
+}
+
+bool Rule::isSystemPath( const string &path )
+{
+    // Each prefix ends in a slash, so the directory itself matches too
+    for( list<string>::iterator i = systemPrefixes.begin(); i != systemPrefixes.end(); i ++ ) {
+        if( !path.compare( 0, i->length() - 1, *i, 0, i->length() - 1 )
+                && (path.length() == i->length() - 1 || path[ i->length() - 1 ] == '/') ) {
+            return true;
+        }
+    }
+    return false;
+}
+
 string Rule::expand_command( const string &command, const string &target, Match *m )
 {
     return command;
@@ -389,8 +569,11 @@ void Rule::recalcHash(string target, unsigned char hash[32])
 
     gcry_md_open( &hd, GCRY_MD_SHA256, 0);
     if( targets != NULL ) {
+        // By their canonical names, which are what the records were
+        // made under
         for(list<string>::iterator i = targets->begin(); i != targets->end(); i ++ ) {
-            gcry_md_write( hd, i->c_str(), i->size() );
+            const string &name = ruleName( *i );
+            gcry_md_write( hd, name.c_str(), name.size() );
         }
     }
 
@@ -412,9 +595,443 @@ bool Rule::built( const string &target )
     return buildCache.find( target ) != buildCache.end();
 }
 
-bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists, time_t targetTime )
+Job::Job(Rule *rule, const string &target, Match *m) :
+    done( false ), updated( false ), rule( rule ), target( target ), m( m ),
+    depsKnown( false ), needsRebuild( false ), existenceChanged( false ), stableRuns( 0 ), trustedRuns( 0 ),
+    trusted( false ), depsStarted( false ), pathLookups( 0 ), pathRepeats( 0 ), holds( 0 )
+{
+    list<pair<string, bool> > *deps, *outputs;
+    list<string>::iterator targeti;
+    list<string> files;
+    unsigned char key[32];
+    string name;
+    StatsScope scope( target );
+
+    for(targeti = rule->targets->begin(); targeti != rule->targets->end(); targeti ++ ) {
+        active[ Rule::ruleName( m->substitute( *targeti ) ) ] = this;
+    }
+
+    // Everything the commands wrote last time has to be newer than the
+    // dependencies, not only the target asked for
+    rule->recalcHash( target, hash );
+    files.push_back( target );
+    name = OUTPUTS_PREFIX + printhash( hash );
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+    outputs = retrieve_dependencies( key );
+    if( outputs != NULL ) {
+        for( list<pair<string, bool> >::iterator i = outputs->begin(); i != outputs->end(); i ++ ) {
+            if( i->first != target ) files.push_back( i->first );
+        }
+        delete outputs;
+    }
+    if( fileTimeEarliest( files, &targetTime ) ) {
+        // An output is missing, so definitely rebuild
+        targetTime = 0;
+    }
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << "Try to build: " << *rule->targets->begin() << "(" << target << "," << targetTime << ")" << endl;
+    }
+    indentation ++;
+
+    // The listed dependencies come first, then the ones the commands were
+    // found to use last time
+    for( list<pair<string,bool> >::iterator i = rule->declaredDeps->begin(); i != rule->declaredDeps->end(); i ++ ) {
+        checks.push_back( pair<string,bool>( Rule::ruleName( m->substitute( i->first ) ), i->second ) );
+    }
+
+    // See if we have dependencies in the database
+    deps = retrieve_dependencies( hash );
+    // If we know the dependencies, we may be able to avoid building. If we
+    // don't know the dependencies, we definitely have to rebuild.
+    if( deps != NULL ) {
+        depsKnown = true;
+        checks.splice( checks.end(), *deps );
+        delete deps;
+    } else if( get_debug_level( DEBUG_REASON ) ) {
+        cout << "Dependencies unknown, must build \"" << target << "\"" << endl;
+    }
+
+    if( depsKnown && Rule::trustRuns > 0 ) {
+        name = STABILITY_PREFIX + printhash( hash );
+        gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+        deps = retrieve_dependencies( key );
+        if( deps != NULL && !deps->empty() ) {
+            istringstream in( deps->front().first );
+            in >> stableDigest >> stableRuns >> trustedRuns;
+        }
+        delete deps;
+    }
+}
+
+Job::~Job()
+{
+    delete m;
+}
+
+void Job::hold()
+{
+    holds ++;
+}
+
+void Job::release()
+{
+    holds --;
+    if( done && holds == 0 ) delete this;
+}
+
+bool Job::reaches(Job *job)
+{
+    if( job == this ) return true;
+    for( multiset<Job *>::iterator i = blockers.begin(); i != blockers.end(); i ++ ) {
+        if( (*i)->reaches( job ) ) return true;
+    }
+    return false;
+}
+
+void Job::check()
+{
+    pair<Rule *, Match *> r;
+    map<string, bool>::iterator i;
+    string builds;
+    bool rebuilt;
+    Job *job;
+    StatsScope scope( target );
+
+    if( !depsStarted ) startDeps();
+
+    while( !checks.empty() ) {
+        const string &dep = checks.front().first;
+
+        if( depsKnown ) {
+            if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+                indent();
+                cout << "Dependency " << dep << "(" << checks.front().second << ")" << endl;
+            }
+        } else {
+            // Even though we don't know the auto-generated dependencies, there
+            // may be explicit dependencies, so build those
+            if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+                cout << "Building explicit dependency `" << dep << "'" << endl;
+            }
+        }
+
+        // A fingerprint is never built
+        if( depsKnown && !dep.compare( 0, sizeof(FINGERPRINT_PREFIX) - 1, FINGERPRINT_PREFIX ) ) {
+            if( !checked( false, false ) ) return;
+            continue;
+        }
+
+        rebuilt = false;
+        r = Rule::find( dep, &builds );
+        if( r.first ) {
+            job = r.first->start( builds, r.second, &rebuilt );
+            if( job != NULL && waitFor( job, builds ) ) return;
+            // Its job may have finished since it was started
+            i = depsRebuilt.find( builds );
+            if( job == NULL && i != depsRebuilt.end() ) rebuilt |= i->second;
+        }
+        if( !checked( r.first != NULL, rebuilt ) ) return;
+    }
+
+    if( depsKnown ) {
+        if( !needsRebuild ) {
+            finish( false );
+            return;
+        }
+        if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+            cout << "Dependency updated, must build" << endl;
+        }
+    }
+
+    // Commands that have used the same files for long enough are trusted to
+    // go on doing so, until one of those files appears or goes away
+    trusted = depsKnown && Rule::trustRuns > 0 && !existenceChanged && stableRuns >= Rule::trustRuns
+        && trustedRuns + 1 < Rule::trustEvery;
+    if( trusted ) {
+        if( get_debug_level( DEBUG_REASON ) ) {
+            indent();
+            cout << "Dependencies of \"" << target << "\" unchanged for " << stableRuns << " builds, running untraced" << endl;
+        }
+    } else {
+        clear_dependencies( hash );
+    }
+    if( Rule::oneShell && rule->commands->size() > 1 ) {
+        string script;
+
+        // Each command is a group of its own, so the shell exits with the
+        // status of the first one to fail, whatever the command contains
+        for(list<string >::iterator i = rule->commands->begin(); i != rule->commands->end(); i ++ ) {
+            script += "{\n" + rule->expand_command( *i, target, m ) + "\n} || exit $?\n";
+        }
+        scripts.push_back( script );
+    } else {
+        for(list<string >::iterator i = rule->commands->begin(); i != rule->commands->end(); i ++ ) {
+            scripts.push_back( rule->expand_command( *i, target, m ) );
+        }
+    }
+    next();
+}
+
+bool Job::checked(bool hasRule, bool rebuilt)
+{
+    pair<string, bool> dep = checks.front();
+
+    checks.pop_front();
+    if( depsKnown ) {
+        if( !dep.first.compare( 0, sizeof(FINGERPRINT_PREFIX) - 1, FINGERPRINT_PREFIX ) ) {
+            needsRebuild |= checkFingerprint( dep.first );
+        } else {
+            needsRebuild |= checkDep( dep.first, dep.second, hasRule, rebuilt );
+        }
+        if( Rule::plotter != NULL ) {
+            Rule::plotter->output( target, dep.first );
+        }
+    } else if( !hasRule && !fileExists( dep.first ) ) {
+        if( get_debug_level( DEBUG_REASON ) ) {
+            cout << "Cannot build explicit dep `" << dep.first << "'" << endl;
+        }
+        finish( false );
+        return false;
+    }
+    return true;
+}
+
+void Job::startDeps()
+{
+    pair<Rule *, Match *> r;
+    string builds;
+    bool rebuilt;
+    Job *job;
+
+    // They're still checked in order once started, as they finish. An
+    // explicit dependency newer than the target may be out of date itself,
+    // so it's started like the rest.
+    depsStarted = true;
+    for( list<pair<string, bool> >::iterator i = checks.begin(); i != checks.end(); i ++ ) {
+        if( depsKnown && !i->first.compare( 0, sizeof(FINGERPRINT_PREFIX) - 1, FINGERPRINT_PREFIX ) ) continue;
+        r = Rule::find( i->first, &builds );
+        if( r.first == NULL ) continue;
+        rebuilt = false;
+        job = r.first->start( builds, r.second, &rebuilt );
+        if( job == NULL ) {
+            depsRebuilt[ builds ] = rebuilt;
+        } else {
+            waitFor( job, builds );
+        }
+    }
+}
+
+bool Job::waitFor(Job *job, const string &builds)
+{
+    multimap<Job *, string>::iterator i;
+
+    if( job->reaches( this ) ) return false;
+    for( i = depJobs.lower_bound( job ); i != depJobs.upper_bound( job ); i ++ ) {
+        if( i->second == builds ) return true;
+    }
+    if( depJobs.find( job ) == depJobs.end() ) {
+        blockers.insert( job );
+        job->jobWaiters.push_back( this );
+    }
+    depJobs.insert( pair<Job *, string>( job, builds ) );
+    return true;
+}
+
+void Job::waited(Job *job)
+{
+    multimap<Job *, string>::iterator i;
+    StatsScope scope( target );
+
+    blockers.erase( blockers.find( job ) );
+    for( i = depJobs.lower_bound( job ); i != depJobs.upper_bound( job ); i ++ ) {
+        depsRebuilt[ i->second ] = job->updated;
+    }
+    depJobs.erase( job );
+    check();
+}
+
+void Job::next()
+{
+    if( !scripts.empty() ) {
+        string command = scripts.front(), depfile;
+
+        scripts.pop_front();
+        // A compiler's dependency file says what it read, for much less
+        // than tracing it costs
+        if( trusted ) {
+            startUntraced( command );
+            return;
+        }
+        if( !Rule::useDepfiles || !depfile_for_command( command, &depfile ) ) {
+            depfile.clear();
+        }
+        start( command, depfile );
+        return;
+    }
+
+    if( trusted ) {
+        // What was recorded last time stands
+        saveStability();
+        finish( true );
+        return;
+    }
+
+    saveOutputs();
+    dropWritten();
+    foldSystemPaths();
+    if( Rule::trustRuns > 0 ) saveStability();
+    add_dependencies( hash, dependencies );
+    dependencies.clear();
+    finish( true );
+}
+
+void Job::callback_done()
+{
+    StatsScope scope( target );
+
+    next();
+}
+
+void Job::finish(bool updated)
+{
+    list<pair<ParkedAccess *, Job *> > parked;
+    list<Job *> waiting;
+    map<string, Job *>::iterator i;
+    list<string>::iterator targeti;
+
+    done = true;
+    this->updated = updated;
+    indentation --;
+
+    // Dependencies still being built aren't waited for any more
+    for( multimap<Job *, string>::iterator j = depJobs.begin(); j != depJobs.end(); j = depJobs.upper_bound( j->first ) ) {
+        j->first->jobWaiters.remove( this );
+        blockers.erase( blockers.find( j->first ) );
+    }
+    depJobs.clear();
+    if( updated ) {
+        if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+            indent();
+            cout << pathRepeats << " of " << pathLookups << " path lookups repeated ("
+                 << (pathLookups ? 100 * pathRepeats / pathLookups : 0) << "%), "
+                 << Rule::canonicalHits << " canonical names from cache so far" << endl;
+            indent();
+            cout << "Done trying to build: " << *rule->targets->begin() << "(" << target << "," << targetTime << ")" << endl;
+        }
+        if( Rule::plotter != NULL ) {
+            for( set<pair<string, bool> >::iterator j = dependencies.begin();
+                                                    j != dependencies.end();
+                                                    j ++ ) {
+                Rule::plotter->output( target, j->first );
+            }
+        }
+    }
+
+    for(targeti = rule->targets->begin(); targeti != rule->targets->end(); targeti ++ ) {
+        i = active.find( Rule::ruleName( m->substitute( *targeti ) ) );
+        if( i != active.end() && i->second == this ) active.erase( i );
+    }
+
+    // What's let go can start and finish other jobs before this returns
+    hold();
+    parked.swap( parkedWaiters );
+    waiting.swap( jobWaiters );
+    for( list<pair<ParkedAccess *, Job *> >::iterator j = parked.begin(); j != parked.end(); j ++ ) {
+        j->second->blockers.erase( j->second->blockers.find( this ) );
+        resume( j->first );
+    }
+    for( list<Job *>::iterator j = waiting.begin(); j != waiting.end(); j ++ ) {
+        (*j)->waited( this );
+    }
+    release();
+}
+
+void Job::callback_entry(std::string filename)
+{
+    pair<Rule *, Match *> r;
+    ParkedAccess *access;
+    string builds;
+    bool rebuilt;
+    Job *job;
+    StatsScope scope( target );
+
+    pathLookups ++;
+    int &seen = seenPaths[ filename ];
+    if( seen & SEEN_ENTRY ) {
+        pathRepeats ++;
+        return;
+    }
+    seen |= SEEN_ENTRY;
+
+    string canon = Rule::canonicalName( filename );
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        ::print(canon);
+    }
+
+    // Rules don't change during a build, and nothing is built twice, so a
+    // path with no rule, or whose target is already built, never holds up
+    // an access again
+    r = Rule::find( canon, &builds );
+    if( r.first == NULL ) {
+        settle();
+    } else {
+        job = r.first->start( builds, r.second, &rebuilt );
+        if( job == NULL ) settle();
+        // Wait for it, unless it's already waiting for this one, as when a
+        // command looks up its own target
+        if( job != NULL && !job->reaches( this ) ) {
+            // Waiting here instead would run other jobs' callbacks under
+            // the ones that led to this
+            access = park();
+            if( access == NULL ) {
+                throw runtime_wexception( "Cannot hold an access to " + canon + " until it's built" );
+            }
+            blockers.insert( job );
+            job->parkedWaiters.push_back( pair<ParkedAccess *, Job *>( access, this ) );
+            // Another thread looking it up meanwhile has to wait too
+            seenPaths[ filename ] &= ~SEEN_ENTRY;
+        }
+        dependencies.insert( pair<string,bool>(canon, true) );
+    }
+}
+
+void Job::callback_exit(std::string filename, bool success)
+{
+    int flag = success ? SEEN_EXISTS : SEEN_MISSING;
+    StatsScope scope( target );
+
+    pathLookups ++;
+    int &seen = seenPaths[ filename ];
+    if( seen & flag ) {
+        pathRepeats ++;
+        return;
+    }
+    seen |= flag;
+
+    string canon = Rule::canonicalName( filename );
+    dependencies.insert( pair<string,bool>(canon, success) );
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        ::print(canon, success);
+    }
+}
+
+void Job::callback_write(std::string filename, bool removed)
+{
+    StatsScope scope( target );
+    string canon = Rule::canonicalName( filename );
+
+    written[ canon ] = !removed;
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << (removed ? "Removed " : "Wrote ") << canon << endl;
+    }
+}
+
+bool Job::checkDep(const string &dep, bool exists, bool hasRule, bool rebuilt)
 {
-    pair<Rule *,Match *>r;
     // If the file has a rule, we need to try to rebuild it, and rebuild if that
     // succeeds.
     // If the file doesn't have a rule, then:
@@ -424,18 +1041,12 @@ bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists
     // If the file existed before and doesn't exist now, we need to rebuild.
     // If the file existed before and still exists, we need to rebuild if the
     // file is newer
-    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
-        indent();
-        cout << "Dependency " << target << "(" << exists << ")" << endl;
-    }
-    r = Rule::find(target);
-    if( r.first ) {
+    if( hasRule ) {
         // Use a rule to rebuild
-        if( r.first->execute( target, r.second ) ) {
-            delete r.second;
+        if( rebuilt ) {
             // It was rebuilt, so we need to rebuild the primary target
             if( get_debug_level( DEBUG_REASON ) ) {
-                cout << "Dependency \"" << target << "\" rebuilt, need to rebuild \"" << ruleTarget << "\"" << endl;
+                cout << "Dependency \"" << dep << "\" rebuilt, need to rebuild \"" << target << "\"" << endl;
             }
             return true;
         } else {
@@ -443,11 +1054,11 @@ bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists
             time_t t;
             bool isDir;
 
-            delete r.second;
             // It was rebuilt, so we need to rebuild the primary target
             // If it wasn't rebuilt, but is already newer, we still
             // have to rebuild.
-            status = !fileTime(target, &t, &isDir);
+            status = !fileTime(dep, &t, &isDir);
+            existenceChanged |= !status;
             if( !status || (t > targetTime && !isDir) ) {
                 if( get_debug_level( DEBUG_REASON ) ) {
                     indent();
@@ -456,9 +1067,9 @@ bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists
                     t1 = t1.substr(0, t1.length() - 1);
                     t2 = t2.substr(0, t2.length() - 1);
                     if( !status ) {
-                        cout << "Dependency \"" << ruleTarget << "\" missing, need to rebuild \"" << ruleTarget << "\"" << endl;
+                        cout << "Dependency \"" << target << "\" missing, need to rebuild \"" << target << "\"" << endl;
                     } else {
-                        cout << ruleTarget << "(" << t2 << ") is newer than target (" << t1 << "), build needed" << endl;
+                        cout << target << "(" << t2 << ") is newer than target (" << t1 << "), build needed" << endl;
                     }
                 }
                 return true;
@@ -469,20 +1080,21 @@ bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists
         time_t t;
         bool isDir;
 
-        status = !fileTime(target, &t, &isDir);
+        status = !fileTime(dep, &t, &isDir);
+        existenceChanged |= status ^ exists;
         if( (status ^ exists) || (status && t > targetTime && !isDir) ) {
             if( get_debug_level( DEBUG_REASON ) ) {
                 indent();
                 if( status && !exists ) {
-                    cout << "No rule to rebuild \"" << target << "\" and it has been created, must rebuild \"" << ruleTarget << "\"" << endl;
+                    cout << "No rule to rebuild \"" << dep << "\" and it has been created, must rebuild \"" << target << "\"" << endl;
                 } else if( !status && exists ) {
-                    cout << "No rule to rebuild \"" << target << "\" and it has been deleted, must rebuild \"" << ruleTarget << "\"" << endl;
+                    cout << "No rule to rebuild \"" << dep << "\" and it has been deleted, must rebuild \"" << target << "\"" << endl;
                 } else {
                     string t1 = ctime(&t);
                     string t2 = ctime(&targetTime);
                     t1 = t1.substr(0, t1.length() - 1);
                     t2 = t2.substr(0, t2.length() - 1);
-                    cout << "No rule to rebuild \"" << target << "\"(" << t1 << ") and it is newer than \"" << ruleTarget << "\"(" << t2 << "), must rebuild \"" << ruleTarget << "\"" << endl;
+                    cout << "No rule to rebuild \"" << dep << "\"(" << t1 << ") and it is newer than \"" << target << "\"(" << t2 << "), must rebuild \"" << target << "\"" << endl;
                 }
             }
             return true;
@@ -491,3 +1103,216 @@ bool Rule::checkDep( const string &ruleTarget, const string &target, bool exists
 
     return false;
 }
+
+bool Job::checkFingerprint(const string &name)
+{
+    map<string, pair<bool, time_t> >::iterator i;
+    list<pair<string, bool> > *paths;
+    unsigned char key[32];
+    bool status, isDir;
+    time_t t;
+
+    i = fingerprints.find( name );
+    if( i == fingerprints.end() ) {
+        pair<bool, time_t> f( false, 0 );
+
+        gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+        paths = retrieve_dependencies( key );
+        // Without its record, it can't be known to be unchanged
+        if( paths != NULL ) {
+            f.first = true;
+            for( list<pair<string, bool> >::iterator j = paths->begin(); j != paths->end(); j ++ ) {
+                status = !fileTime( j->first, &t, &isDir );
+                if( status != j->second ) {
+                    f.first = false;
+                    if( get_debug_level( DEBUG_REASON ) ) {
+                        cout << "\"" << j->first << "\" has been " << (status ? "created" : "deleted") << ", toolchain changed" << endl;
+                    }
+                }
+                if( status && !isDir && t > f.second ) f.second = t;
+            }
+            delete paths;
+        }
+        i = fingerprints.insert( pair<string, pair<bool, time_t> >( name, f ) ).first;
+    }
+
+    // Paths of the toolchain may have appeared or gone
+    existenceChanged |= !i->second.first;
+    if( !i->second.first || i->second.second > targetTime ) {
+        if( get_debug_level( DEBUG_REASON ) ) {
+            indent();
+            cout << "Toolchain changed, must rebuild \"" << target << "\"" << endl;
+        }
+        return true;
+    }
+    return false;
+}
+
+void Job::saveOutputs()
+{
+    set<pair<string, bool> > outputs, from;
+    map<string, bool>::iterator i;
+    list<string>::iterator targeti;
+    set<string> declared;
+    unsigned char key[32];
+    string name;
+
+    for(targeti = rule->targets->begin(); targeti != rule->targets->end(); targeti ++ ) {
+        declared.insert( Rule::ruleName( m->substitute( *targeti ) ) );
+    }
+    declared.insert( target );
+
+    // Devices like /dev/null are written, but aren't outputs
+    for( i = written.begin(); i != written.end(); i ++ ) {
+        if( i->second && !Rule::isSystemPath( i->first ) && fileIsRegular( i->first ) ) {
+            outputs.insert( pair<string, bool>( i->first, true ) );
+        }
+    }
+
+    name = OUTPUTS_PREFIX + printhash( hash );
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+    clear_dependencies( key );
+    if( !outputs.empty() ) add_dependencies( key, outputs );
+
+    from.insert( pair<string, bool>( target, true ) );
+    for( set<pair<string, bool> >::iterator j = outputs.begin(); j != outputs.end(); j ++ ) {
+        if( declared.find( j->first ) != declared.end() ) continue;
+        name = PRODUCER_PREFIX + j->first;
+        gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+        clear_dependencies( key );
+        add_dependencies( key, from );
+        Rule::producers[ j->first ] = target;
+    }
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << outputs.size() << " outputs recorded" << endl;
+    }
+}
+
+void Job::dropWritten()
+{
+    set<pair<string, bool> >::iterator i;
+    unsigned long dropped = 0;
+
+    for( i = dependencies.begin(); i != dependencies.end(); ) {
+        if( written.find( i->first ) != written.end() ) {
+            dependencies.erase( i ++ );
+            dropped ++;
+        } else {
+            i ++;
+        }
+    }
+    written.clear();
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << dropped << " paths the commands wrote or removed dropped from the dependencies" << endl;
+    }
+}
+
+void Job::saveStability()
+{
+    set<pair<string, bool> > record;
+    unsigned char digest[32], key[32];
+    ostringstream out;
+    gcry_md_hd_t hd;
+    string name;
+
+    if( trusted ) {
+        trustedRuns ++;
+    } else {
+        gcry_md_open( &hd, GCRY_MD_SHA256, 0 );
+        for( set<pair<string, bool> >::iterator i = dependencies.begin(); i != dependencies.end(); i ++ ) {
+            gcry_md_write( hd, i->first.c_str(), i->first.size() + 1 );
+            gcry_md_putc( hd, i->second );
+        }
+        gcry_md_final( hd );
+        memcpy( digest, gcry_md_read( hd, 0 ), 32 );
+        gcry_md_close( hd );
+
+        name = printhash( digest );
+        if( name == stableDigest ) {
+            stableRuns ++;
+        } else {
+            stableDigest = name;
+            stableRuns = 1;
+        }
+        trustedRuns = 0;
+    }
+
+    out << stableDigest << " " << stableRuns << " " << trustedRuns;
+    record.insert( pair<string, bool>( out.str(), true ) );
+    name = STABILITY_PREFIX + printhash( hash );
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+    clear_dependencies( key );
+    add_dependencies( key, record );
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << "Same dependencies for " << stableRuns << " traced builds, and "
+             << trustedRuns << " untraced builds since" << endl;
+    }
+}
+
+void Job::foldSystemPaths()
+{
+    // Whether each system path looked at has a rule, which for a system
+    // path only depends on the makefile
+    static unordered_map<string, bool> hasRule;
+    unordered_map<string, bool>::iterator j;
+    set<pair<string, bool> > system;
+    set<pair<string, bool> >::iterator i;
+    list<pair<string, bool> > *recorded;
+    pair<Rule *, Match *> r;
+    unsigned char digest[32], key[32];
+    gcry_md_hd_t hd;
+    string name;
+
+    for( i = dependencies.begin(); i != dependencies.end(); ) {
+        if( !Rule::isSystemPath( i->first ) ) {
+            i ++;
+            continue;
+        }
+        // A file the project builds there, like a project under /usr/src,
+        // has to stay a dependency of its own to be built
+        j = hasRule.find( i->first );
+        if( j == hasRule.end() ) {
+            r = Rule::find( i->first );
+            if( r.first != NULL ) delete r.second;
+            j = hasRule.insert( pair<string, bool>( i->first, r.first != NULL ) ).first;
+        }
+        if( !j->second ) {
+            system.insert( *i );
+            dependencies.erase( i ++ );
+        } else {
+            i ++;
+        }
+    }
+    if( system.empty() ) return;
+
+    gcry_md_open( &hd, GCRY_MD_SHA256, 0 );
+    for( i = system.begin(); i != system.end(); i ++ ) {
+        gcry_md_write( hd, i->first.c_str(), i->first.size() + 1 );
+        gcry_md_putc( hd, i->second );
+    }
+    gcry_md_final( hd );
+    memcpy( digest, gcry_md_read( hd, 0 ), 32 );
+    gcry_md_close( hd );
+
+    name = FINGERPRINT_PREFIX + printhash( digest );
+    gcry_md_hash_buffer( GCRY_MD_SHA256, key, name.data(), name.length() );
+
+    // Records are never changed once written, as other rules may share them
+    recorded = retrieve_dependencies( key );
+    if( recorded == NULL ) {
+        add_dependencies( key, system );
+    }
+    delete recorded;
+
+    if( get_debug_level( DEBUG_DEPENDENCIES ) ) {
+        indent();
+        cout << system.size() << " system paths folded into " << name << endl;
+    }
+    dependencies.insert( pair<string, bool>( name, true ) );
+}
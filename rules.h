@@ -4,6 +4,8 @@
 #include <string>
 #include <list>
 #include <set>
+#include <map>
+#include <unordered_map>
 #include "subprocess.h"
 #include "match.h"
 #include "plotter.h"
@@ -14,7 +16,11 @@
  * characters include * which is used as a wildcard, and {} which are used
  * to reference previous wildcards
  */
-class Rule : public Subprocess {
+class Job;
+
+class Rule {
+    friend class Job;
+
     public:
         Rule();
 
@@ -44,11 +50,23 @@ class Rule : public Subprocess {
          */
         static bool build(const std::string &target, bool *updated);
 
-        /* Run the commands to build the targets */
+        /* Run the commands to build the targets, and wait for them. Returns
+         * whether the target was updated.
+         */
         bool execute(const std::string &target, Match *m);
 
-        /* Find a rule that matches a target */
-        static std::pair<Rule *, Match *> find(const std::string &target);
+        /* Start building a target, taking ownership of m. Returns NULL if
+         * the build is already over, with updated set, or otherwise the job
+         * building it, which may have been started before.
+         */
+        Job *start(const std::string &target, Match *m, bool *updated);
+
+        /* Find a rule that matches a target. A file no rule lists, which a
+         * rule's commands wrote the last time they ran, is found through the
+         * outputs recorded for it. builds is set to the target to start the
+         * rule with.
+         */
+        static std::pair<Rule *, Match *> find(const std::string &target, std::string *builds = NULL);
 
         /* Indicates whether a dependency can be satisfied with known files */
         static bool canBeBuilt(const std::string &file);
@@ -56,16 +74,6 @@ class Rule : public Subprocess {
         /* Indicates whether or not a rule matches a target */
         virtual bool match(const std::string &target, Match **match);
 
-        /* Callback when entering a kernel filesystem call when running the
-         * commands
-         */
-        void callback_entry(std::string filename);
-
-        /* Callback when leaving a kernel filesystem call when running the
-         * commands
-         */
-        void callback_exit(std::string filename, bool success);
-
         /*
          * Check the rules database and set the default target, if no target
          * was specified
@@ -76,6 +84,34 @@ class Rule : public Subprocess {
          * Set up for debug output
          */
         static void setPlotter( Plotter *p );
+
+        /*
+         * Run all the commands of a rule in one traced shell, rather than
+         * one per command. The shell stops at the first command that fails.
+         */
+        static void setOneShell( bool oneShell );
+
+        /*
+         * Run compilers that write a dependency file (-MD or -MMD) without
+         * tracing them, and take their dependencies from the file
+         */
+        static void setUseDepfiles( bool useDepfiles );
+
+        /*
+         * Once a rule has been traced runs times in a row with the same
+         * dependencies, run its commands untraced and keep them. It's traced
+         * again every so many builds, and whenever one of its dependencies
+         * has been created or deleted.
+         */
+        static void setTrust( unsigned int runs, unsigned int every );
+
+        /*
+         * Treat paths starting with prefix as part of the toolchain. They are
+         * recorded together in one fingerprint, which is checked once per
+         * build, rather than as dependencies of each rule.
+         */
+        static void addSystemPrefix( const std::string &prefix );
+
         /*
          * Perform variable expansion
          */
@@ -86,25 +122,201 @@ class Rule : public Subprocess {
          */
         bool built( const std::string &target );
 
-        /*
-         * Check if a dependency need to be rebuilt (see rules.txt for the conditions
-         * in which it does)
-         */
-        bool checkDep( const std::string &ruleTarget, const std::string &target, bool exists, time_t targetTime );
-
     protected:
         /* Recalculate a hash that describes this rule. It's based on all paramters
          * that are user-configurable
          */
         void recalcHash(std::string target, unsigned char hash[32]);
 
+        /* The canonical name of a path the commands looked up */
+        static std::string canonicalName(const std::string &path);
+
+        /* The canonical name of a target or dependency a rule names, which
+         * is kept as written until it's needed */
+        static const std::string &ruleName(const std::string &name);
+
+        /* Find a rule that lists a target. A target is looked for among the
+         * rules indexed under its last component, so one whose name a rule
+         * gives is a symlink to a file named otherwise isn't found by the
+         * file's name. */
+        static std::pair<Rule *, Match *> findListed(const std::string &target);
+
+        /* The last component of a name a rule gives, or what follows its
+         * wildcard, with partial set. It's taken from the name as written
+         * unless only the canonical name says what it is. */
+        static std::string lastName(const std::string &name, bool *partial);
+
+        /* Index the rules by the lastName of each of their targets */
+        static void index();
+
+        /* Whether a path is under one of the system prefixes */
+        static bool isSystemPath(const std::string &path);
+
+        /* The target whose commands last wrote a path no rule lists, or an
+         * empty string */
+        static std::string producer(const std::string &path);
+
+        /* Whether the commands wrote path the last time they built target */
+        bool hasOutput(const std::string &target, const std::string &path);
+
         static std::set<std::string> buildCache;
         std::list<std::string> *targets;
         std::list<std::string> *commands;
         std::list<std::pair<std::string, bool> > *declaredDeps;
-        std::set<std::pair<std::string, bool> > dependencies;
+        static std::unordered_map<std::string, std::string> canonicalCache;
+        static std::unordered_map<std::string, std::string> producers;
+        static std::unordered_map<std::string, std::string> ruleNames;
+        static std::unordered_map<std::string, std::list<Rule *> > byName;
+        static std::map<std::string, std::list<Rule *> > bySuffix;
+        static bool indexed;
+        static unsigned long canonicalHits;
         static std::list<Rule *> rules;
         static Plotter *plotter;
+        static bool oneShell;
+        static bool useDepfiles;
+        static unsigned int trustRuns;
+        static unsigned int trustEvery;
+        static std::list<std::string> systemPrefixes;
+};
+
+/* The build of one target by a rule: checking its dependencies, then running
+ * its commands. A job waits for the builds it needs without holding up the
+ * others, and an access by one of its commands to a target still to be built
+ * is parked until that target's job has finished.
+ */
+class Job : public Subprocess {
+    public:
+        Job(Rule *rule, const std::string &target, Match *m);
+        ~Job();
+
+        /* Check the dependencies, and run the commands if needed. Returns
+         * once something has to be waited for.
+         */
+        void check();
+
+        /* Keep the job from being deleted once it's finished */
+        void hold();
+        void release();
+
+        /* Whether this job waits, maybe through others, for job */
+        bool reaches(Job *job);
+
+        /* Callback when entering a kernel filesystem call when running the
+         * commands
+         */
+        void callback_entry(std::string filename);
+
+        /* Callback when leaving a kernel filesystem call when running the
+         * commands
+         */
+        void callback_exit(std::string filename, bool success);
+
+        /* Callback when the commands create, write or remove a file */
+        void callback_write(std::string filename, bool removed);
+
+        /* Callback once a command has finished, to run the next one */
+        void callback_done();
+
+        /* The jobs that haven't finished, by each of their targets */
+        static std::map<std::string, Job *> active;
+
+        /* For each fingerprint checked so far, whether its paths are as
+         * recorded, and the newest of their times */
+        static std::map<std::string, std::pair<bool, time_t> > fingerprints;
+
+        bool done;
+        bool updated;
+
+    protected:
+        /* Finish with the dependency at the front of checks, built by a
+         * rule or not. Returns false if the job is over.
+         */
+        bool checked(bool hasRule, bool rebuilt);
+
+        /* Whether the target needs rebuilding because of a dependency (see
+         * rules.txt for the conditions in which it does)
+         */
+        bool checkDep(const std::string &dep, bool exists, bool hasRule, bool rebuilt);
+
+        /* Whether a fingerprint has changed since the target was built */
+        bool checkFingerprint(const std::string &name);
+
+        /* Record the files the commands left written as the outputs of the
+         * target, and as built by it */
+        void saveOutputs();
+
+        /* Take the paths the commands wrote out of dependencies */
+        void dropWritten();
+
+        /* Count how many builds in a row have found the same dependencies,
+         * or been run untraced since they were last traced */
+        void saveStability();
+
+        /* Replace the system paths in dependencies by their fingerprint */
+        void foldSystemPaths();
+
+        /* Start building every dependency that needs it, before waiting
+         * for any of them */
+        void startDeps();
+
+        /* Wait for the job building a dependency, unless it's already
+         * waiting for this one. Returns whether it's waited for. */
+        bool waitFor(Job *job, const std::string &builds);
+
+        /* Called by a job this one waits for once it has finished */
+        void waited(Job *job);
+
+        /* Run the next command, or finish once there are none left */
+        void next();
+
+        /* Let everything waiting for this job go on */
+        void finish(bool updated);
+
+        Rule *rule;
+        std::string target;
+        Match *m;
+        unsigned char hash[32];
+        time_t targetTime;
+        /* Whether the dependencies are known from the database, or only the
+         * declared ones can be built first */
+        bool depsKnown;
+        bool needsRebuild;
+        /* Whether a dependency has been created or deleted, rather than only
+         * changed, so the commands must be traced to see what they use */
+        bool existenceChanged;
+        /* For trust mode: the hash of the dependencies last traced, how many
+         * traced builds in a row found them, how many untraced builds there
+         * have been since, and whether this one is untraced */
+        std::string stableDigest;
+        unsigned long stableRuns;
+        unsigned long trustedRuns;
+        bool trusted;
+        std::list<std::pair<std::string, bool> > checks;
+        /* The dependencies being built by other jobs, by the job, and
+         * whether each one that has finished was rebuilt */
+        bool depsStarted;
+        std::multimap<Job *, std::string> depJobs;
+        std::map<std::string, bool> depsRebuilt;
+        std::list<std::string> scripts;
+        std::set<std::pair<std::string, bool> > dependencies;
+        /* Raw paths the commands have looked up, each with the SEEN_* flags
+         * for what has been recorded about it, so a repeated lookup costs
+         * one hash lookup */
+        std::unordered_map<std::string, int> seenPaths;
+        /* Canonical names of the paths the commands created, wrote or
+         * removed, and whether they were left there. They're the rule's own
+         * outputs and temporaries, not dependencies, whether they were
+         * looked up before or after. */
+        std::map<std::string, bool> written;
+        unsigned long pathLookups;
+        unsigned long pathRepeats;
+        /* The jobs this one waits for, once for each wait */
+        std::multiset<Job *> blockers;
+        /* Waiting for this one: accesses by the commands of other jobs, and
+         * jobs checking their dependencies */
+        std::list<std::pair<ParkedAccess *, Job *> > parkedWaiters;
+        std::list<Job *> jobWaiters;
+        int holds;
 };
 
 #endif /* __RULES_H__ */
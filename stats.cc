@@ -0,0 +1,135 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <iostream>
+#include "stats.h"
+#include "argpc.h"
+
+using namespace std;
+
+struct StatsRule
+{
+    StatsRule( )
+    {
+        for( int i = 0; i < STAT_COUNT; i ++ ) counts[ i ] = 0;
+    }
+
+    atomic<unsigned long> counts[ STAT_COUNT ];
+};
+
+static bool enabled = false;
+static bool byRule = false;
+static StatsRule totals;
+// Only added to on the main thread. Entries are never removed, so tracer
+// threads can hold on to them.
+static map<string, StatsRule *> rules;
+static thread_local StatsRule *current = NULL;
+
+static void enable_stats( )
+{
+    enabled = true;
+}
+
+static void enable_stats_by_rule( )
+{
+    enabled = true;
+    byRule = true;
+}
+
+void stats_init( )
+{
+    Argpc::getInstance()->addOption( ArgpcOption( "stats", 'S', "Count what ptmake does itself while building, such as stops of traced commands, path lookups and database operations, and report it at the end", enable_stats ) );
+    Argpc::getInstance()->addOption( ArgpcOption( "stats-by-rule", "Report the --stats counters for each target built as well", enable_stats_by_rule ) );
+}
+
+bool stats_enabled( )
+{
+    return enabled;
+}
+
+void stats_add( StatCounter counter, unsigned long n )
+{
+    stats_add( current, counter, n );
+}
+
+void stats_add( StatsRule *rule, StatCounter counter, unsigned long n )
+{
+    if( !enabled ) return;
+    totals.counts[ counter ].fetch_add( n, memory_order_relaxed );
+    if( rule != NULL ) rule->counts[ counter ].fetch_add( n, memory_order_relaxed );
+}
+
+unsigned long long stats_clock( )
+{
+    return chrono::duration_cast<chrono::nanoseconds>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+StatsRule *stats_rule( )
+{
+    return current;
+}
+
+StatsScope::StatsScope( const string &rule ) : saved( current )
+{
+    if( !byRule ) return;
+
+    StatsRule *&r = rules[ rule ];
+    if( r == NULL ) r = new StatsRule;
+    current = r;
+}
+
+StatsScope::StatsScope( StatsRule *rule ) : saved( current )
+{
+    current = rule;
+}
+
+StatsScope::~StatsScope( )
+{
+    current = saved;
+}
+
+static double ms( unsigned long long ns )
+{
+    return ns / 1000000.0;
+}
+
+static void report( ostream &out, const StatsRule &s, const char *indent )
+{
+    unsigned long stops = s.counts[ STAT_STOPS ];
+    unsigned long canonicalize = s.counts[ STAT_CANONICALIZE ];
+    unsigned long find = s.counts[ STAT_FIND ];
+    unsigned long db = s.counts[ STAT_DB ];
+
+    out << indent << stops << " stops, tracees stopped " << ms( s.counts[ STAT_STOPPED_TIME ] ) << "ms"
+        << " (" << (stops ? s.counts[ STAT_STOPPED_TIME ] / stops / 1000.0 : 0) << "us per stop)"
+        << " and held " << ms( s.counts[ STAT_HELD_TIME ] ) << "ms, "
+        << s.counts[ STAT_BYTES_READ ] << " bytes read from them" << endl;
+    out << indent << canonicalize << " paths canonicalized in " << ms( s.counts[ STAT_CANONICALIZE_TIME ] ) << "ms"
+        << " (" << (canonicalize ? s.counts[ STAT_CANONICALIZE_TIME ] / canonicalize / 1000.0 : 0) << "us each), "
+        << s.counts[ STAT_CANONICALIZE_CACHED ] << " more from cache, " << s.counts[ STAT_STAT ] << " stat calls" << endl;
+    out << indent << find << " rule lookups scanning " << s.counts[ STAT_FIND_SCANNED ] << " rules"
+        << " (" << (find ? (double)s.counts[ STAT_FIND_SCANNED ] / find : 0) << " each)" << endl;
+    out << indent << db << " database operations in " << ms( s.counts[ STAT_DB_TIME ] ) << "ms"
+        << " (" << (db ? s.counts[ STAT_DB_TIME ] / db / 1000.0 : 0) << "us each)" << endl;
+}
+
+void stats_report( ostream &out )
+{
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+
+    if( !enabled ) return;
+
+    out.setf( ios::fixed, ios::floatfield );
+    out.precision( 3 );
+    out << "Statistics:" << endl;
+    report( out, totals, "  " );
+    if( byRule ) {
+        for( map<string, StatsRule *>::iterator i = rules.begin(); i != rules.end(); i ++ ) {
+            out << i->first << ":" << endl;
+            report( out, *i->second, "  " );
+        }
+    }
+    out.flags( flags );
+    out.precision( precision );
+}
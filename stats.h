@@ -0,0 +1,107 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <iosfwd>
+#include <string>
+
+/*
+ * Counters of the work ptmake does itself while building, to see what
+ * tracing and bookkeeping add to the commands' own time. Turned on with
+ * --stats and reported at the end of the build.
+ */
+
+enum StatCounter {
+    // ptrace stops handled, and the time tracees spent stopped while they
+    // were handled
+    STAT_STOPS,
+    STAT_STOPPED_TIME,
+    // Time tracees were held at an access until a callback let them go on
+    STAT_HELD_TIME,
+    // Bytes of paths read out of tracees
+    STAT_BYTES_READ,
+    STAT_CANONICALIZE,
+    STAT_CANONICALIZE_TIME,
+    // Canonical names of looked up paths found in the cache instead
+    STAT_CANONICALIZE_CACHED,
+    // Rule::find calls, and the rules they looked at
+    STAT_FIND,
+    STAT_FIND_SCANNED,
+    STAT_STAT,
+    STAT_DB,
+    STAT_DB_TIME,
+
+    STAT_COUNT
+};
+
+/*
+ * The counters of one rule, when they're kept for each rule
+ */
+struct StatsRule;
+
+/*
+ * Add the command line options
+ */
+void stats_init( );
+
+/*
+ * Whether counters are kept. Checked before doing anything costly to
+ * count something.
+ */
+bool stats_enabled( );
+
+/*
+ * Add to a counter, and to the rule being counted against on this thread.
+ * Safe from any thread.
+ */
+void stats_add( StatCounter counter, unsigned long n = 1 );
+
+/*
+ * Add to a counter and to a given rule
+ */
+void stats_add( StatsRule *rule, StatCounter counter, unsigned long n );
+
+/*
+ * Nanoseconds on a monotonic clock, to time things with
+ */
+unsigned long long stats_clock( );
+
+/*
+ * The rule counted against on this thread, or NULL
+ */
+StatsRule *stats_rule( );
+
+/*
+ * Count against a rule on this thread while in scope. Rules are looked up
+ * by name on the main thread only.
+ */
+class StatsScope
+{
+public:
+    StatsScope( const std::string &rule );
+    StatsScope( StatsRule *rule );
+    ~StatsScope( );
+
+private:
+    StatsRule *saved;
+};
+
+/*
+ * Add the time until it goes out of scope to a counter
+ */
+class StatsTimer
+{
+public:
+    StatsTimer( StatCounter counter ) : counter( counter ), start( stats_enabled() ? stats_clock() : 0 ) { }
+    ~StatsTimer( ) { if( start ) stats_add( counter, stats_clock() - start ); }
+
+private:
+    StatCounter counter;
+    unsigned long long start;
+};
+
+/*
+ * Write out the counters, and those of each rule if asked for
+ */
+void stats_report( std::ostream &out );
+
+#endif /* __STATS_H__ */
@@ -1,11 +1,64 @@
 #ifndef __SUBPROCESS_H__
 #define __SUBPROCESS_H__
 
+#include <iosfwd>
 #include <string>
 
+/*
+ * How traced commands are stopped on filesystem accesses
+ */
+enum TraceMode {
+    /* Stop on every system call with PTRACE_SYSCALL */
+    TRACE_SYSCALL,
+    /* Install a seccomp filter so only path-taking system calls stop */
+    TRACE_SECCOMP,
+    /* Load libptmake_preload.so into commands to report accesses, and only
+       trace exec calls and processes it can't get into with ptrace */
+    TRACE_PRELOAD,
+    /* Only follow the processes, to know when the command has finished.
+       Used for commands whose dependencies come from a dependency file. */
+    TRACE_NONE
+};
+
+/*
+ * What is done with a program a command runs, and everything it starts
+ */
+enum ToolPolicy {
+    /* Trace its accesses as usual */
+    TOOL_TRACE,
+    /* Report none of its accesses. For tools like mkdir and echo, whose
+       accesses are never dependencies. */
+    TOOL_DETACH,
+    /* Only report the existing files named in its arguments, for tools
+       whose inputs are all on their command line */
+    TOOL_ARGV
+};
+
+/*
+ * Register the command line options controlling how commands are traced
+ */
+void subprocess_init( );
+
+/*
+ * Start the process commands are launched from. Called once the options have
+ * been parsed, and before the makefile is read, so it stays small.
+ */
+void subprocess_start( );
+
+/*
+ * Write how many ptrace stops each tracer thread has handled, and how fast,
+ * and how many stops each system call took. Part of the --stats report.
+ */
+void subprocess_report( std::ostream &out );
+
+/* A command being traced, and an access held up by a callback */
+struct TraceSession;
+struct ParkedAccess;
+
 class Subprocess
 {
 public:
+    Subprocess( );
     virtual ~Subprocess( );
     
     /* Execute a command, while calling callbacks on entry and exit to each
@@ -13,11 +66,86 @@ public:
      */
     void trace(std::string command);
 
+    /* Start a command and return straight away. The callbacks are called
+     * from dispatch, and callback_done once the command has finished. Only
+     * one command at a time is run for each object.
+     *
+     * Given a depfile, the command's accesses aren't traced. Instead, once
+     * it has finished, callback_exit is called for each file the make-style
+     * dependency file it wrote lists, and callback_write for the file itself.
+     */
+    void start(std::string command, std::string depfile = "");
+
+    /* Start a command without tracing it. Only callback_done is called. */
+    void startUntraced(std::string command);
+
+    /* Wait for something to happen to any running command and handle it.
+     * Returns false if no commands are running.
+     */
+    static bool dispatch( );
+
     /* Callback when entering a filesystem access */
     virtual void callback_entry(std::string filename) = 0;
     
     /* Callback when leaving a filesystem access */
     virtual void callback_exit(std::string filename, bool success) = 0;
+
+    /* Callback when a command has created, written or removed a file */
+    virtual void callback_write(std::string filename, bool removed);
+
+    /* Callback once a command given to start has finished */
+    virtual void callback_done( );
+
+    /* Choose how commands are traced. Falls back to TRACE_SYSCALL if the
+     * kernel does not support seccomp filters
+     */
+    static void setTraceMode( TraceMode mode );
+
+    /* Only stop at the entry to filesystem accesses. Whether each path
+     * exists is checked once the command has finished, and passed to
+     * callback_exit then.
+     */
+    static void setEntryOnly( bool entryOnly );
+
+    /* Never report paths starting with prefix, as the program gave them,
+     * to the callbacks. /proc, /sys and /tmp are always excluded.
+     */
+    static void addExclusion( const std::string &prefix );
+
+    /* Choose what is done with a program once a command execs it. The tool
+     * is a program name, or a full path to match only that binary. Only
+     * mkdir, echo, printf, true, false and sleep have a policy other than
+     * TOOL_TRACE to start with.
+     */
+    static void setToolPolicy( const std::string &tool, ToolPolicy policy );
+
+protected:
+    /* From callback_entry, hold the access where it is once the callback
+     * returns, rather than letting it go on. Other commands, and other
+     * processes of this one, keep running. Returns NULL if the access can't
+     * be held, otherwise a handle to pass to resume.
+     */
+    ParkedAccess *park( );
+
+    /* Let a parked access go on */
+    static void resume( ParkedAccess *access );
+
+    /* From callback_entry, tell the tracer that no access to this path will
+     * be parked again, by any command. Threads tracing commands elsewhere
+     * then let such accesses go on straight away, instead of holding them
+     * until the callback has returned.
+     */
+    void settle( );
+
+    static TraceMode traceMode;
+    static bool entryOnly;
+
+    /* The command this object is running, if any */
+    TraceSession *session;
+
+private:
+    void begin(const std::string &command, const std::string &depfile, TraceMode mode);
+    void launch( );
 };
 
 #endif /* __SUBPROCESS_H__ */
@@ -1,9 +1,11 @@
 #include <map>
+#include <list>
 #include <string>
 #include <sys/ptrace.h>
 #include <iostream>
 #include "subprocess.h"
 #include "debug.h"
+#include "depfile.h"
 
 using namespace std;
 
@@ -30,7 +32,65 @@ void debugprint( int pid, long syscall_id, int returnVal )
     }
     cout << pid << " made a system call " << syscall_id << " returning " << returnVal << endl;
 }
+
+TraceMode Subprocess::traceMode = TRACE_SYSCALL;
+bool Subprocess::entryOnly = false;
+
+void subprocess_init( )
+{
+}
+
+void subprocess_start( )
+{
+}
+
+void subprocess_report( std::ostream &out )
+{
+}
+
+void Subprocess::setTraceMode( TraceMode mode )
+{
+    // No seccomp on this platform
+}
+
+void Subprocess::setEntryOnly( bool entryOnly )
+{
+}
+
+void Subprocess::addExclusion( const std::string &prefix )
+{
+}
+
+void Subprocess::setToolPolicy( const std::string &tool, ToolPolicy policy )
+{
+}
+
+Subprocess::Subprocess( ) : session( NULL )
+{
+}
+
+void Subprocess::callback_done( )
+{
+}
+
+void Subprocess::callback_write( string filename, bool removed )
+{
+}
+
 void Subprocess::trace(string command)
+{
+    start( command );
+}
+
+// Nothing is traced here yet anyway
+void Subprocess::startUntraced(string command)
+{
+    start( command );
+}
+
+// Commands are run one at a time here, so each one has finished, and
+// callback_done been called, by the time start returns
+void Subprocess::start(string command, string depfile)
 {
     char l;
     int i, status;
@@ -44,6 +104,9 @@ void Subprocess::trace(string command)
     }
     cout << command << endl;
 
+    // So one left from an earlier run isn't read if the compiler fails
+    if( !depfile.empty() ) unlink( depfile.c_str() );
+
     child = fork();
     if( child == 0 ) {
         ptrace(PT_TRACE_ME, 0, NULL, NULL);
@@ -147,4 +210,33 @@ void Subprocess::trace(string command)
     if( get_debug_level( DEBUG_SUBPROCESS ) ) {
         cout << "Completed " << command << endl;
     }
+    if( !depfile.empty() ) {
+        list<string> deps;
+
+        if( parse_depfile( depfile, &deps ) ) {
+            for( list<string>::iterator i = deps.begin(); i != deps.end(); i ++ ) {
+                callback_exit( *i, true );
+            }
+            callback_write( depfile, false );
+        }
+    }
+    callback_done();
+}
+
+bool Subprocess::dispatch( )
+{
+    return false;
+}
+
+ParkedAccess *Subprocess::park( )
+{
+    return NULL;
+}
+
+void Subprocess::resume( ParkedAccess *access )
+{
+}
+
+void Subprocess::settle( )
+{
 }
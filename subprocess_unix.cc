@@ -1,203 +1,3113 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <string.h>
-#include <map>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/reg.h>
 #include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <asm/ptrace-abi.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <limits.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fstream>
+#include <sstream>
+#include <list>
+#include <map>
+#include <set>
 #include <syscall.h>
+#include <signal.h>
+#include <stddef.h>
+#include <vector>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <pthread.h>
 #include "subprocess.h"
 #include "debug.h"
+#include "stats.h"
+#include "argpc.h"
+#include "exception.h"
+#include "preload.h"
+#include "depfile.h"
 
 using namespace std;
 
-struct
-{
-    int id;
-    const char *statement;
-} static debugprints[] = {
-    { __NR_stat, "stat" },
-    { __NR_access, "access" },
-    { __NR_open, "open" },
-    { __NR_set_thread_area, "set_thread_area" },
-    { __NR_fstat, "fstat" },
-    { __NR_fcntl, "fcntl" },
-    { __NR_execve, "execve" },
-    { __NR_dup2, "dup2" },
-    { __NR_exit_group, "exit group" },
-    { __NR_mmap, "mmap" },
-    { __NR_mprotect, "mprotect" },
-    { __NR_getppid, "getppid" },
-    { __NR_brk, "brk" },
-    { __NR_geteuid, "geteuid" },
-    { __NR_getpid, "getpid" },
-    { __NR_munmap, "munmap" },
-    { __NR_read, "read" },
-    { __NR_write, "write" },
-    { __NR_rt_sigaction, "rt_sigaction" },
-    { __NR_close, "close" },
-    { __NR_clone, "clone" },
-    { __NR_wait4, "wait4" },
-    { __NR_unlink, "unlink" },
+#if defined(__i386)
+#define SYSCALL_ID(r) ((r).orig_eax)
+#define RETURNVAL(r) ((r).eax)
+#define ARG1(r) ((r).ebx)
+#define ARG2(r) ((r).ecx)
+#define ARG3(r) ((r).edx)
+#define ARG4(r) ((r).esi)
+#define ARG5(r) ((r).edi)
+#define ARG6(r) ((r).ebp)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_I386
+#elif defined(__x86_64)
+#define SYSCALL_ID(r) ((r).orig_rax)
+#define RETURNVAL(r) ((r).rax)
+#define ARG1(r) ((r).rdi)
+#define ARG2(r) ((r).rsi)
+#define ARG3(r) ((r).rdx)
+#define ARG4(r) ((r).r10)
+#define ARG5(r) ((r).r8)
+#define ARG6(r) ((r).r9)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_X86_64
+#endif
+
+// Everything we need to know about a process at a system call stop, fetched
+// with a single ptrace call
+struct SyscallRegs
+{
+    // PTRACE_SYSCALL_INFO_* if the kernel told us what kind of stop this
+    // is, PTRACE_SYSCALL_INFO_NONE otherwise
+    int op;
+    long syscall_id;
+    unsigned long args[ 6 ];
+    long returnVal;
+};
+
+// What a system call does to its path, besides looking it up
+enum Effect {
+    // Only reads it, if anything
+    EFFECT_NONE,
+    // Reads it, or writes it when the write flags are set
+    EFFECT_OPEN,
+    // Creates or truncates it
+    EFFECT_CREATE,
+    // Removes it
+    EFFECT_REMOVE,
+    // Moves it to a new path, which is written
+    EFFECT_RENAME
+};
+
+// What we remember about a traced process between the entry to a system call
+// and its exit
+struct TraceeState
+{
+    TraceeState() : insyscall( false ), recorded( false ), changingDir( false ), fullTrace( false ), ignored( false ), announced( false ), parked( false ), writing( EFFECT_NONE ), info( NULL ) { }
+
+    bool insyscall;
+    // Whether callback_entry was called for path, and callback_exit is due
+    bool recorded;
+    // Whether the call may change cwd, so it's to be read again at the exit
+    bool changingDir;
+    // Stop on every system call, rather than relying on the seccomp filter
+    bool fullTrace;
+    // Running a program, or started by one, whose accesses aren't reported,
+    // under its tool policy
+    bool ignored;
+    // Whether its creator's fork or clone event has been seen, or it needs
+    // none. A new thread can run and exit before that arrives.
+    bool announced;
+    // Held at the entry to a call by a callback, and how to let it go on
+    bool parked;
+    enum __ptrace_request resume;
+    // What the call the process is in does to path, reported at its exit,
+    // and where a rename moves it to
+    enum Effect writing;
+    string newPath;
+    // The call the process is in
+    const struct SyscallInfo *info;
+    string path;
+    // The process's working directory, which relative paths are resolved
+    // against. Inherited across fork and clone, and kept up to date by
+    // tracing chdir and fchdir.
+    string cwd;
+};
+
+// Cleared the first time the kernel tells us it doesn't support the call,
+// on whichever tracer thread that is
+static atomic<bool> syscallInfoSupported( true );
+static atomic<bool> vmReadvSupported( true );
+
+// How the result of a system call tells us whether its path exists
+enum Existence {
+    // The path exists if the call succeeded
+    EXISTS_ON_SUCCESS,
+    // The path exists unless the call failed because it was missing
+    EXISTS_UNLESS_ENOENT
+};
+
+// Description of a system call, and how to find a dependency in its arguments
+struct SyscallInfo
+{
+    long id;
+    const char *name;
+    // Argument holding the path, or -1 if the call doesn't take a path
+    int pathArg;
+    // Argument holding the directory fd a relative path is relative to, or -1
+    int dirfdArg;
+    // Argument holding flags that may indicate a write, or -1
+    int flagsArg;
+    // Flag bits meaning the path is written, not read
+    unsigned long writeFlags;
+    // If set, the flags must equal writeFlags rather than contain one of them
+    bool writeExact;
+    Existence existence;
+    // Whether the call needn't be traced in preload mode, because
+    // libptmake_preload.so sees it or has no use for it
+    bool interposed;
+    // Whether the call changes the current directory
+    bool changesDir;
+    Effect effect;
+    // For a rename, the arguments holding the new path and the directory fd
+    // it's relative to
+    int newPathArg;
+    int newDirfdArg;
+};
+
+#define WRITE_OPEN (O_CREAT | O_WRONLY | O_TRUNC)
+
+// Every system call we know by name. Those with a path argument, or that
+// change directory, are the ones that are traced; the rest are only here for
+// debug output.
+static const SyscallInfo syscallTable[] = {
+    { __NR_open, "open", 0, -1, 1, WRITE_OPEN, false, EXISTS_ON_SUCCESS, true, false, EFFECT_OPEN, -1, -1 },
+    { __NR_openat, "openat", 1, 0, 2, WRITE_OPEN, false, EXISTS_ON_SUCCESS, true, false, EFFECT_OPEN, -1, -1 },
+    { __NR_creat, "creat", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_CREATE, -1, -1 },
+    { __NR_unlink, "unlink", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_REMOVE, -1, -1 },
+    { __NR_unlinkat, "unlinkat", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_REMOVE, -1, -1 },
+    { __NR_rename, "rename", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_RENAME, 1, -1 },
+    { __NR_renameat, "renameat", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_RENAME, 3, 2 },
+#if defined(__NR_renameat2)
+    { __NR_renameat2, "renameat2", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_RENAME, 3, 2 },
+#endif
+    { __NR_stat, "stat", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_lstat, "lstat", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_access, "access", 0, -1, 1, W_OK, true, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_faccessat, "faccessat", 1, 0, 2, W_OK, true, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+#if defined(__NR_faccessat2)
+    { __NR_faccessat2, "faccessat2", 1, 0, 2, W_OK, true, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+#endif
+#if defined(__NR_statx)
+    { __NR_statx, "statx", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+#endif
+    { __NR_chdir, "chdir", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, true, EFFECT_NONE, -1, -1 },
+    { __NR_fchdir, "fchdir", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, true, EFFECT_NONE, -1, -1 },
+    { __NR_readlink, "readlink", 0, -1, -1, 0, false, EXISTS_UNLESS_ENOENT, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_readlinkat, "readlinkat", 1, 0, -1, 0, false, EXISTS_UNLESS_ENOENT, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_execve, "execve", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+#if defined(__NR_execveat)
+    { __NR_execveat, "execveat", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+#endif
 #if defined(__x86_64)
-    { __NR_arch_prctl, "arch prctl" },
+    { __NR_newfstatat, "newfstatat", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_arch_prctl, "arch prctl", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
 #endif
 #if defined(__i386__)
-    { __NR_geteuid32, "geteuid32" },
-    { __NR_stat64, "stat64" },
-    { __NR_fstat64, "fstat64" },
-    { __NR_mmap2, "mmap2" },
+    { __NR_stat64, "stat64", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_lstat64, "lstat64", 0, -1, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_fstatat64, "fstatat64", 1, 0, -1, 0, false, EXISTS_ON_SUCCESS, true, false, EFFECT_NONE, -1, -1 },
+    { __NR_geteuid32, "geteuid32", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_fstat64, "fstat64", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_mmap2, "mmap2", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
 #endif
+    { __NR_set_thread_area, "set_thread_area", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_fstat, "fstat", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_fcntl, "fcntl", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_dup2, "dup2", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_exit_group, "exit group", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_mmap, "mmap", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_mprotect, "mprotect", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_getppid, "getppid", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_brk, "brk", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_geteuid, "geteuid", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_getpid, "getpid", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_munmap, "munmap", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_read, "read", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_write, "write", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_rt_sigaction, "rt_sigaction", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_close, "close", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_clone, "clone", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
+    { __NR_wait4, "wait4", -1, -1, -1, 0, false, EXISTS_ON_SUCCESS, false, false, EFFECT_NONE, -1, -1 },
 };
 
-void debugprint( int pid, long syscall_id, int returnVal )
+// With --stats, the stops at the entry and at the exit of each call in
+// syscallTable, and of any other call at the end
+static unsigned long syscallStops[ sizeof(syscallTable)/sizeof(syscallTable[0]) + 1 ][ 2 ];
+
+static void count_syscall_stop( const SyscallInfo *info, bool entry )
+{
+    size_t i = info != NULL ? info - syscallTable : sizeof(syscallTable)/sizeof(syscallTable[0]);
+
+    __atomic_add_fetch( &syscallStops[ i ][ entry ? 0 : 1 ], 1, __ATOMIC_RELAXED );
+}
+
+// Table entries indexed by system call number, so each stop is one lookup
+static vector<const SyscallInfo *> index_syscalls( )
 {
+    vector<const SyscallInfo *> index;
     unsigned int i;
 
-    for( i = 0; i < sizeof(debugprints)/sizeof(debugprints[0]); i ++ ) {
-        if( debugprints[ i ].id == syscall_id ) {
-            cout << pid << ": " << debugprints[ i ].statement << " call (" << returnVal << ")" << endl;
-            return;
+    for( i = 0; i < sizeof(syscallTable)/sizeof(syscallTable[0]); i ++ ) {
+        if( (unsigned long)syscallTable[ i ].id >= index.size() ) {
+            index.resize( syscallTable[ i ].id + 1, NULL );
         }
+        index[ syscallTable[ i ].id ] = &syscallTable[ i ];
     }
-    cout << pid << " made a system call " << syscall_id << " returning " << returnVal << endl;
+    return index;
 }
 
-#if defined(__i386)
-#define RETURNVAL (4 * EAX)
-#define ARG1 (4 * EBX)
-#define ARG2 (4 * ECX)
-#define ARG3 (4 * EDX)
-#elif defined(__x86_64)
-#define RETURNVAL (8 * RAX)
-#define ARG1 (8 * RDI)
-#define ARG2 (8 * RSI)
-#define ARG3 (8 * RDX)
-#endif
+static const SyscallInfo *find_syscall( long syscall_id )
+{
+    // Built once, by whichever thread gets here first, while any others
+    // wait for it
+    static const vector<const SyscallInfo *> syscallIndex = index_syscalls();
 
-void Subprocess::trace(string command)
+    if( syscall_id < 0 || (unsigned long)syscall_id >= syscallIndex.size() ) return NULL;
+    return syscallIndex[ syscall_id ];
+}
+
+void debugprint( int pid, long syscall_id, int returnVal )
 {
-    char l;
-    int i, status;
-    long syscall_id, c, returnVal;
-    pid_t child;
-    bool insyscall;
-    map<pid_t,bool> insyscallMap;
+    const SyscallInfo *info = find_syscall( syscall_id );
 
-    if( get_debug_level( DEBUG_SUBPROCESS ) ) {
-        cout << "Executing ";
+    if( info != NULL ) {
+        cout << pid << ": " << info->name << " call (" << returnVal << ")" << endl;
+    } else {
+        cout << pid << " made a system call " << syscall_id << " returning " << returnVal << endl;
     }
-    cout << command << endl;
+}
 
-    child = fork();
-    if( child == 0 ) {
-        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
-        execl("/bin/sh", "sh", "-c", command.c_str(), (char *)NULL);
+// Whether a system call at entry is reading a path, rather than writing it
+static bool is_read( const SyscallInfo *info, const SyscallRegs &regs )
+{
+    unsigned long flags;
+
+    if( info->effect != EFFECT_NONE && info->effect != EFFECT_OPEN ) return false;
+    if( info->flagsArg < 0 ) return true;
+
+    flags = regs.args[ info->flagsArg ];
+    if( info->writeExact ) {
+        return flags != info->writeFlags;
     } else {
-        while(1) {
-            child = wait(&status);
-            ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC);
-            if(WIFEXITED(status)) break;
-
-            // Make sure we're being called for a trap
-            if(!WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP) {
-                ptrace(PTRACE_SYSCALL, child, NULL, NULL);
-                continue;
-            }
-#if defined(__i386)
-            syscall_id = ptrace(PTRACE_PEEKUSER, child, 4 * ORIG_EAX, NULL);
-#elif defined(__x86_64)
-            syscall_id = ptrace(PTRACE_PEEKUSER, child, 8 * ORIG_RAX, NULL);
-#endif
-#ifdef DEBUG
-            returnVal = ptrace(PTRACE_PEEKUSER, child, RETURNVAL, NULL);
-            if( get_debug_level( DEBUG_SUBPROCESS ) ) {
-                debugprint( child, syscall_id, returnVal );
+        return !(flags & info->writeFlags);
+    }
+}
+
+// Whether the return value of a system call means its path exists
+static bool path_exists( const SyscallInfo *info, long returnVal )
+{
+    switch( info->existence ) {
+        case EXISTS_UNLESS_ENOENT:
+            return returnVal >= 0 || (returnVal != -ENOENT && returnVal != -ENOTDIR);
+        case EXISTS_ON_SUCCESS:
+        default:
+            return returnVal >= 0;
+    }
+}
+
+// A path relative to a directory fd other than the current directory is
+// turned into an absolute path using the fd's entry in /proc
+static void resolve_dirfd( pid_t child, int dirfdArg, const SyscallRegs &regs, string *path )
+{
+    char link[ 64 ], buf[ PATH_MAX ];
+    ssize_t length;
+    int dirfd;
+
+    if( dirfdArg < 0 || (*path)[ 0 ] == '/' ) return;
+
+    dirfd = (int)regs.args[ dirfdArg ];
+    if( dirfd == AT_FDCWD ) return;
+
+    snprintf( link, sizeof(link), "/proc/%d/fd/%d", (int)child, dirfd );
+    length = readlink( link, buf, sizeof(buf) );
+    if( length <= 0 ) return;
+
+    *path = string( buf, length ) + "/" + *path;
+}
+
+// Read a process's working directory from /proc. This is the kernel's own
+// name for it, so it's canonical, whatever path chdir was given.
+static void read_cwd( pid_t child, string *cwd )
+{
+    char link[ 64 ], buf[ PATH_MAX ];
+    ssize_t length;
+
+    snprintf( link, sizeof(link), "/proc/%d/cwd", (int)child );
+    length = readlink( link, buf, sizeof(buf) );
+    if( length > 0 ) {
+        cwd->assign( buf, length );
+    }
+}
+
+// Make a path absolute by putting the directory it's relative to in front,
+// and drop "." components and repeated slashes. ".." is left for the
+// canonicalization, as the component before it may be a symlink.
+static void absolute_path( const string &cwd, string *path )
+{
+    string in, out;
+    size_t start, end;
+
+    if( (*path)[ 0 ] == '/' ) {
+        in.swap( *path );
+    } else {
+        in = cwd + "/" + *path;
+    }
+
+    out.reserve( in.length() );
+    for( start = 0; start < in.length(); start = end + 1 ) {
+        end = in.find( '/', start );
+        if( end == string::npos ) end = in.length();
+        if( end == start || (end == start + 1 && in[ start ] == '.') ) continue;
+        out += '/';
+        out.append( in, start, end - start );
+    }
+    if( out.empty() ) out = "/";
+    path->swap( out );
+}
+
+TraceMode Subprocess::traceMode = TRACE_SECCOMP;
+bool Subprocess::entryOnly = false;
+
+// Where libptmake_preload.so was found, for TRACE_PRELOAD
+static string preloadLibrary;
+
+// Connection to the process commands are launched from, if there is one.
+// Forking ptmake is cheaper until the makefile has some 10000 rules, so the
+// zygote is only used when asked for, or for tracer threads, which need it.
+static int zygoteSocket = -1;
+static bool useZygote = false;
+static bool launchChosen = false;
+
+// Written to from the SIGCHLD handler, so the preload server can wait for
+// both reported accesses and ptrace stops
+static int sigchldPipe[ 2 ] = { -1, -1 };
+
+// Where to record the accesses commands make, and where to replay them from
+// instead of running the commands
+static string recordFile;
+static string replayFile;
+
+// How many threads to trace commands on, besides the main thread
+static unsigned int tracerCount = 0;
+
+static void trace_mode( std::string option )
+{
+    if( option == "seccomp" ) {
+        Subprocess::setTraceMode( TRACE_SECCOMP );
+    } else if( option == "preload" ) {
+        Subprocess::setTraceMode( TRACE_PRELOAD );
+    } else {
+        Subprocess::setTraceMode( TRACE_SYSCALL );
+    }
+}
+
+static void entry_only( )
+{
+    Subprocess::setEntryOnly( true );
+}
+
+static void exclude_path( std::string option )
+{
+    Subprocess::addExclusion( option );
+}
+
+static void launch_mode( std::string option )
+{
+    useZygote = option != "fork";
+    launchChosen = true;
+}
+
+static void record_trace( std::string option )
+{
+    recordFile = option;
+}
+
+static void replay_trace( std::string option )
+{
+    replayFile = option;
+}
+
+static void tracer_count( std::string option )
+{
+    tracerCount = strtoul( option.c_str(), NULL, 10 );
+}
+
+static void tool_policy( std::string option )
+{
+    size_t equals = option.find( '=' );
+    string policy = equals == string::npos ? "" : option.substr( equals + 1 );
+
+    if( equals == 0 || (policy != "trace" && policy != "detach" && policy != "argv") ) {
+        cerr << "Invalid tool policy: " << option << endl;
+        exit( 1 );
+    }
+    Subprocess::setToolPolicy( option.substr( 0, equals ), policy == "detach" ? TOOL_DETACH : policy == "argv" ? TOOL_ARGV : TOOL_TRACE );
+}
+
+void subprocess_init( )
+{
+    ArgpcOption traceOption( "trace", 't', "mode", "Select how commands are traced", trace_mode );
+    traceOption.addValue( "seccomp" );
+    traceOption.addValue( "syscall" );
+    traceOption.addValue( "preload" );
+
+    Argpc::getInstance()->addOption( traceOption );
+    Argpc::getInstance()->addOption( ArgpcOption( "entry-only", 'e', "Skip the stop at the exit of each traced call, and check which paths exist once each command has finished", entry_only ) );
+    ArgpcOption launchOption( "launch", 'l', "method", "Select how commands are started: from a small process forked at startup, which is cheaper with very large makefiles, or by forking ptmake. Forking is the default without --tracers.", launch_mode );
+    launchOption.addValue( "zygote" );
+    launchOption.addValue( "fork" );
+    Argpc::getInstance()->addOption( launchOption );
+    Argpc::getInstance()->addOption( ArgpcOption( "tracers", 'N', "count", "Trace commands on COUNT threads, each handling the stops of the commands it started, rather than on the main thread", tracer_count ) );
+    Argpc::getInstance()->addOption( ArgpcOption( "exclude", 'x', "prefix", "Never record paths starting with PREFIX as dependencies. May be given more than once.", exclude_path ) );
+    Argpc::getInstance()->addOption( ArgpcOption( "tool", 'P', "tool=policy", "Choose what is done with TOOL once a command runs it: trace its accesses, detach from it and what it starts, or only record the files named in its argv. May be given more than once.", tool_policy ) );
+    Argpc::getInstance()->addOption( ArgpcOption( "record", 'r', "file", "Record every access the commands make to FILE, to be replayed later", record_trace ) );
+    Argpc::getInstance()->addOption( ArgpcOption( "replay", 'R', "file", "Pass the accesses recorded in FILE to the build instead of running any commands, to measure ptmake's own overhead", replay_trace ) );
+}
+
+static bool install_seccomp_filter( bool preload );
+
+// Whether the trace mode has been checked against what the system allows,
+// which is done once, whether or not it was chosen on the command line
+static bool traceModeChecked = false;
+
+// Check whether a seccomp filter can be installed, by installing one in a
+// child. The kernel may not support them, or a filter already in place, as
+// in some containers, may not let another be added.
+static bool seccomp_supported( )
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+    if( pid == 0 ) {
+        _exit( install_seccomp_filter( false ) ? 0 : 1 );
+    }
+    if( pid < 0 ) return false;
+    while( waitpid( pid, &status, 0 ) < 0 && errno == EINTR );
+    return WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+// Byte-wise trie of the paths that are never dependencies, so a path can be
+// matched a chunk at a time as it is read out of the tracee, and reading
+// stops as soon as it is known to be excluded
+class ExclusionTrie
+{
+public:
+    enum {
+        NO_MATCH = -1,
+        EXCLUDED = -2
+    };
+
+    ExclusionTrie( );
+
+    // Exclude every path starting with path, or only path itself
+    void add( const string &path, bool prefix );
+
+    // Match n more bytes of a path starting from state, which is 0 for a new
+    // path. Returns EXCLUDED once an excluded prefix has been seen, and
+    // NO_MATCH once nothing that follows can make the path excluded.
+    int step( int state, const char *s, size_t n ) const;
+
+    // Whether a path matched up to state is excluded if it ends there
+    bool ends( int state ) const;
+
+    bool excluded( const char *s, size_t n ) const;
+
+private:
+    struct Node
+    {
+        int next[ 256 ];
+        bool prefix;
+        bool exact;
+    };
+
+    vector<Node> nodes;
+};
+
+ExclusionTrie::ExclusionTrie( ) : nodes( 1 )
+{
+    // We want to exclude proc and sys because they contain files whose
+    // timestamps constantly increment, and we exclude tmp because tools may
+    // write then read temporary files there, and we don't want to depend on
+    // those.
+    add( "/proc", true );
+    add( "/sys", true );
+    add( "/tmp", true );
+    add( ".", false );
+}
+
+void ExclusionTrie::add( const string &path, bool prefix )
+{
+    string::const_iterator i;
+    int state = 0;
+
+    // An empty prefix would exclude everything
+    if( path.empty() ) return;
+
+    for( i = path.begin(); i != path.end(); i ++ ) {
+        unsigned char c = *i;
+
+        if( nodes[ state ].next[ c ] == 0 ) {
+            // Indexes are taken first, as growing nodes moves them
+            int added = nodes.size();
+            nodes.resize( added + 1 );
+            nodes[ state ].next[ c ] = added;
+        }
+        state = nodes[ state ].next[ c ];
+    }
+    if( prefix ) {
+        nodes[ state ].prefix = true;
+    } else {
+        nodes[ state ].exact = true;
+    }
+}
+
+int ExclusionTrie::step( int state, const char *s, size_t n ) const
+{
+    size_t i;
+
+    for( i = 0; i < n && state >= 0; i ++ ) {
+        state = nodes[ state ].next[ (unsigned char)s[ i ] ];
+        if( state == 0 ) return NO_MATCH;
+        if( nodes[ state ].prefix ) return EXCLUDED;
+    }
+    return state;
+}
+
+bool ExclusionTrie::ends( int state ) const
+{
+    return state == EXCLUDED || (state >= 0 && nodes[ state ].exact);
+}
+
+bool ExclusionTrie::excluded( const char *s, size_t n ) const
+{
+    return ends( step( 0, s, n ) );
+}
+
+static ExclusionTrie exclusions;
+
+// Paths that are never dependencies
+static bool excluded( const string &s )
+{
+    return exclusions.excluded( s.data(), s.length() );
+}
+
+void Subprocess::addExclusion( const std::string &prefix )
+{
+    exclusions.add( prefix, true );
+}
+
+// Programs that aren't traced as usual, by name or full path. Those here to
+// start with only create directories or write to their output.
+static map<string, ToolPolicy> tool_defaults( )
+{
+    static const char *const detached[] = { "mkdir", "echo", "printf", "true", "false", "sleep" };
+    map<string, ToolPolicy> policies;
+
+    for( unsigned int i = 0; i < sizeof(detached)/sizeof(detached[0]); i ++ ) {
+        policies[ detached[ i ] ] = TOOL_DETACH;
+    }
+    return policies;
+}
+
+static map<string, ToolPolicy> toolPolicies = tool_defaults();
+
+void Subprocess::setToolPolicy( const std::string &tool, ToolPolicy policy )
+{
+    if( policy == TOOL_TRACE ) {
+        toolPolicies.erase( tool );
+    } else {
+        toolPolicies[ tool ] = policy;
+    }
+}
+
+// Look up the policy for the program a process has just exec'd: by the path
+// of its binary, then that binary's name, then the name it was run as, which
+// is what tells multi-call binaries apart. Fills in its arguments.
+static ToolPolicy find_tool_policy( pid_t child, vector<string> *args )
+{
+    map<string, ToolPolicy>::iterator i;
+    char file[ 64 ], exe[ PATH_MAX ];
+    string arg, name;
+    ssize_t length;
+
+    args->clear();
+    if( toolPolicies.empty() ) return TOOL_TRACE;
+
+    snprintf( file, sizeof(file), "/proc/%d/cmdline", (int)child );
+    ifstream cmdline( file );
+    while( getline( cmdline, arg, '\0' ) ) args->push_back( arg );
+
+    snprintf( file, sizeof(file), "/proc/%d/exe", (int)child );
+    length = readlink( file, exe, sizeof(exe) );
+    if( length > 0 && length < (ssize_t)sizeof(exe) ) {
+        name.assign( exe, length );
+        if( (i = toolPolicies.find( name )) != toolPolicies.end() ) return i->second;
+        name.erase( 0, name.find_last_of( '/' ) + 1 );
+        if( (i = toolPolicies.find( name )) != toolPolicies.end() ) return i->second;
+    }
+    if( !args->empty() ) {
+        name = (*args)[ 0 ];
+        name.erase( 0, name.find_last_of( '/' ) + 1 );
+        if( (i = toolPolicies.find( name )) != toolPolicies.end() ) return i->second;
+    }
+    return TOOL_TRACE;
+}
+
+// Split a command into its arguments, if it's simple enough to run without
+// a shell. Quoting, expansions, redirections and the rest are left to the
+// shell rather than having its rules copied here.
+static bool split_command( const string &command, vector<string> *argv )
+{
+    // Words that only mean something to the shell
+    static const char *const shellWords[] = {
+        "!", "{", "}", "case", "do", "done", "elif", "else", "esac", "fi", "for",
+        "function", "if", "in", "select", "then", "until", "while",
+        ".", ":", "alias", "bg", "break", "cd", "command", "continue", "eval",
+        "exec", "exit", "export", "fg", "getopts", "hash", "jobs", "local",
+        "read", "readonly", "return", "set", "shift", "source", "times", "trap",
+        "type", "ulimit", "umask", "unalias", "unset", "wait"
+    };
+    size_t start, end;
+    unsigned int i;
+
+    if( command.find_first_of( "|&;<>()$`\\\"'*?[]{}~#\n" ) != string::npos ) return false;
+
+    argv->clear();
+    for( start = command.find_first_not_of( " \t" ); start != string::npos; start = command.find_first_not_of( " \t", end ) ) {
+        end = command.find_first_of( " \t", start );
+        if( end == string::npos ) end = command.length();
+        argv->push_back( command.substr( start, end - start ) );
+    }
+    if( argv->empty() ) return false;
+
+    // An assignment in front of the command
+    if( (*argv)[ 0 ].find( '=' ) != string::npos ) return false;
+    for( i = 0; i < sizeof(shellWords) / sizeof(shellWords[ 0 ]); i ++ ) {
+        if( (*argv)[ 0 ] == shellWords[ i ] ) return false;
+    }
+    return true;
+}
+
+// Look a program up in PATH the way the shell would. Each place it could have
+// been is added to probes, to be reported to the callbacks as the shell's own
+// lookups were, so a program appearing earlier in PATH is noticed.
+static bool find_program( const string &cwd, const string &name, string *path, vector<pair<string, bool> > *probes )
+{
+    const char *env = getenv( "PATH" );
+    string dirs = env != NULL ? env : "/usr/local/bin:/usr/bin:/bin";
+    size_t start, end;
+    struct stat st;
+    bool found;
+
+    if( name.find( '/' ) != string::npos ) {
+        *path = name;
+        return true;
+    }
+
+    for( start = 0; start <= dirs.length(); start = end + 1 ) {
+        end = dirs.find( ':', start );
+        if( end == string::npos ) end = dirs.length();
+        *path = end == start ? name : dirs.substr( start, end - start ) + "/" + name;
+
+        stats_add( STAT_STAT );
+        found = stat( path->c_str(), &st ) == 0 && S_ISREG( st.st_mode ) && access( path->c_str(), X_OK ) == 0;
+        if( !excluded( *path ) ) {
+            string reported = *path;
+
+            absolute_path( cwd, &reported );
+            probes->push_back( pair<string, bool>( reported, found ) );
+        }
+        if( found ) return true;
+    }
+    return false;
+}
+
+// Fetch the system call number, arguments and return value of a stopped
+// process. PTRACE_GET_SYSCALL_INFO also tells us whether it is an entry or exit
+// stop, but is only available from Linux 5.3, so fall back to PTRACE_GETREGS.
+static bool get_syscall_regs( pid_t child, SyscallRegs *regs )
+{
+    struct user_regs_struct r;
+    int i;
+
+    if( syscallInfoSupported ) {
+        struct __ptrace_syscall_info info;
+
+        if( ptrace( PTRACE_GET_SYSCALL_INFO, child, sizeof(info), &info ) > 0 ) {
+            regs->op = info.op;
+            regs->syscall_id = -1;
+            regs->returnVal = 0;
+            if( info.arch != AUDIT_ARCH_NATIVE ) {
+                // Can't decode system call numbers from other ABIs
+                regs->op = PTRACE_SYSCALL_INFO_NONE;
+            } else if( info.op == PTRACE_SYSCALL_INFO_ENTRY ) {
+                regs->syscall_id = info.entry.nr;
+                for( i = 0; i < 6; i ++ ) regs->args[ i ] = info.entry.args[ i ];
+            } else if( info.op == PTRACE_SYSCALL_INFO_SECCOMP ) {
+                regs->syscall_id = info.seccomp.nr;
+                for( i = 0; i < 6; i ++ ) regs->args[ i ] = info.seccomp.args[ i ];
+            } else if( info.op == PTRACE_SYSCALL_INFO_EXIT ) {
+                regs->returnVal = info.exit.rval;
             }
-#endif
-            switch( syscall_id ) {
-                case __NR_stat:
-                case __NR_access:
-                case __NR_open:
-#if defined(__i386__)
-                case __NR_stat64:
-#endif
-                {
-                    int done;
-                    string s;
-                    map<pid_t,bool>::iterator it = insyscallMap.find(child);
-
-                    if( it != insyscallMap.end() ) {
-                        it->second ^= 1;
-                        insyscall = it->second;
-                    } else {
-                        // New process
-                        insyscallMap[ child ] = true;
-                        insyscall = true;
-                    }
-                    
-                    // See if this is being accessed for write. If it is,
-                    // that's not a dependency
-                    if( syscall_id == __NR_access ) {
-                        returnVal = ptrace(PTRACE_PEEKUSER, child, ARG2, NULL);
-                        if( returnVal == W_OK ) break;
-                    } else if( syscall_id == __NR_open ) {
-                        returnVal = ptrace(PTRACE_PEEKUSER, child, ARG2, NULL);
-                        if( returnVal & O_CREAT ) break;
-                    }
-
-                    // The first argument for all of these 
-                    returnVal = ptrace(PTRACE_PEEKUSER, child, ARG1, NULL);
-                    done = 0;
-                    while( !done ) {
-                        c = ptrace(PTRACE_PEEKDATA, child, returnVal, NULL);
-                        for( i = 0; i < 4; i ++ ) {
-                            l = c & 0xFF;
-                            c >>= 8;
-                            returnVal ++;
-                            if( l == 0 ) {
-                                done = 1;
-                                break;
-                            }
-                            s += l;
-                        }
-                    }
-
-                    // There should be a more elegant way to do this - we want to exclude
-                    // proc and sys because they contain files whose timestamps constantly
-                    // increment, and we exclude tmp because tools may write then read
-                    // temporary files there, and we don't want to depend on those.
-                    if( !strncmp(s.c_str(), "/proc", 5 ) ) break;
-                    if( !strncmp(s.c_str(), "/sys", 4 ) ) break;
-                    if( !strncmp(s.c_str(), "/tmp", 4 ) ) break;
-                    if( !strncmp(s.c_str(), ".", 2 ) ) break;
-
-                    returnVal = ptrace(PTRACE_PEEKUSER, child, RETURNVAL, NULL);
-                    if( insyscall ) {
-                        callback_entry(s);
-                    } else {
-                        callback_exit(s, returnVal >= 0);
-                    }
-                }
+            return true;
+        }
+        if( errno != EIO ) return false;
+        syscallInfoSupported = false;
+    }
+
+    if( ptrace( (enum __ptrace_request)PTRACE_GETREGS, child, NULL, &r ) ) return false;
+
+    regs->op = PTRACE_SYSCALL_INFO_NONE;
+    regs->syscall_id = SYSCALL_ID( r );
+    regs->returnVal = RETURNVAL( r );
+    regs->args[ 0 ] = ARG1( r );
+    regs->args[ 1 ] = ARG2( r );
+    regs->args[ 2 ] = ARG3( r );
+    regs->args[ 3 ] = ARG4( r );
+    regs->args[ 4 ] = ARG5( r );
+    regs->args[ 5 ] = ARG6( r );
+    return true;
+}
+
+// Read a NUL terminated string out of a traced process. Each read stops at a
+// page boundary, so an unmapped page after the string can't fail it. The
+// string is matched against the exclusions as it is read, and skip is set,
+// possibly before all of it has been copied, if it is excluded.
+static bool read_string( pid_t child, unsigned long addr, string *s, bool *skip )
+{
+    static const unsigned long pageSize = sysconf( _SC_PAGESIZE );
+    char buf[ PATH_MAX ];
+    struct iovec local, remote;
+    ssize_t n;
+    char *end;
+    int match = 0;
+
+    s->clear();
+    *skip = false;
+    while( vmReadvSupported && s->length() < PATH_MAX ) {
+        local.iov_base = buf;
+        local.iov_len = pageSize - addr % pageSize;
+        if( local.iov_len > sizeof(buf) ) local.iov_len = sizeof(buf);
+        remote.iov_base = (void *)addr;
+        remote.iov_len = local.iov_len;
+
+        n = process_vm_readv( child, &local, 1, &remote, 1, 0 );
+        if( n > 0 ) stats_add( STAT_BYTES_READ, n );
+        if( n <= 0 ) {
+            if( errno != ENOSYS && errno != EPERM ) return false;
+            vmReadvSupported = false;
+            s->clear();
+            match = 0;
+            break;
+        }
+
+        end = (char *)memchr( buf, 0, n );
+        match = exclusions.step( match, buf, end != NULL ? end - buf : n );
+        if( match == ExclusionTrie::EXCLUDED ) {
+            // No need to read the rest
+            *skip = true;
+            return true;
+        }
+        if( end != NULL ) {
+            s->append( buf, end - buf );
+            *skip = exclusions.ends( match );
+            return true;
+        }
+        s->append( buf, n );
+        addr += n;
+    }
+
+    // No process_vm_readv, copy a word at a time
+    while( s->length() < PATH_MAX ) {
+        long c;
+        unsigned int i;
+
+        errno = 0;
+        c = ptrace( PTRACE_PEEKDATA, child, addr, NULL );
+        if( errno ) return false;
+        stats_add( STAT_BYTES_READ, sizeof(c) );
+        for( i = 0; i < sizeof(c); i ++ ) {
+            if( ((char *)&c)[ i ] == 0 ) {
+                *skip = exclusions.ends( match );
+                return true;
             }
-            if( syscall_id == __NR_exit_group ) {
-                // Detach here - otherwise, the parent of a further subprocess gets a SIGTRAP on child exit
-                insyscallMap.erase(child);
-                ptrace(PTRACE_DETACH, child, NULL, NULL);
-            } else {
-                ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+            match = exclusions.step( match, (char *)&c + i, 1 );
+            if( match == ExclusionTrie::EXCLUDED ) {
+                *skip = true;
+                return true;
             }
+            *s += ((char *)&c)[ i ];
         }
+        addr += sizeof(c);
     }
 
-    if( get_debug_level( DEBUG_SUBPROCESS ) ) {
-        cout << "Completed " << command << endl;
+    // Too long to be a path
+    return false;
+}
+
+// Read a path argument of a system call, made absolute. Returns false if it
+// can't be read or is excluded.
+static bool read_path( pid_t child, const TraceeState *state, const SyscallRegs &regs, int pathArg, int dirfdArg, string *s )
+{
+    bool skip;
+
+    if( !read_string( child, regs.args[ pathArg ], s, &skip ) || skip || s->empty() ) return false;
+    // A path relative to a directory descriptor is only known once the
+    // directory has been looked up, and a relative path is only known to be
+    // excluded once it's been joined to its directory
+    if( (*s)[ 0 ] != '/' ) resolve_dirfd( child, dirfdArg, regs, s );
+    absolute_path( state->cwd, s );
+    return !excluded( *s );
+}
+
+// The preload library is installed next to libptmake.so
+static string find_preload_library( )
+{
+    char buf[ PATH_MAX ];
+    Dl_info info;
+    string path;
+    size_t slash;
+
+    if( !dladdr( (void *)subprocess_init, &info ) || info.dli_fname == NULL ) return "";
+
+    path = info.dli_fname;
+    slash = path.find_last_of( '/' );
+    if( slash == string::npos ) {
+        path = PRELOAD_LIBRARY;
+    } else {
+        path = path.substr( 0, slash + 1 ) + PRELOAD_LIBRARY;
+    }
+
+    // LD_PRELOAD is used from whatever directory the command runs in
+    if( realpath( path.c_str(), buf ) == NULL ) return "";
+    return buf;
+}
+
+void Subprocess::setEntryOnly( bool entryOnly )
+{
+    Subprocess::entryOnly = entryOnly;
+}
+
+void Subprocess::setTraceMode( TraceMode mode )
+{
+    if( mode == TRACE_PRELOAD ) {
+        preloadLibrary = find_preload_library();
+        if( preloadLibrary.empty() ) {
+            if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+                cout << PRELOAD_LIBRARY << " not found, using seccomp" << endl;
+            }
+            mode = TRACE_SECCOMP;
+        }
+    }
+    if( mode != TRACE_SYSCALL && !seccomp_supported() ) {
+        if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+            cout << "seccomp filters not supported, tracing every system call" << endl;
+        }
+        mode = TRACE_SYSCALL;
+    }
+    traceMode = mode;
+    traceModeChecked = true;
+}
+
+// Install a filter in the calling process so that only the system calls in
+// syscallTable that take a path cause a ptrace stop. Everything else runs at
+// full speed. With the preload library, only the calls it can't see stop.
+static bool install_seccomp_filter( bool preload )
+{
+    unsigned int i, count = sizeof(syscallTable)/sizeof(syscallTable[0]);
+    vector<struct sock_filter> filter;
+    struct sock_fprog prog;
+    struct sock_filter insn;
+
+    // Only the native architecture's system call numbers can be decoded
+    insn = (struct sock_filter)BPF_STMT( BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch) );
+    filter.push_back( insn );
+    insn = (struct sock_filter)BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_NATIVE, 1, 0 );
+    filter.push_back( insn );
+    insn = (struct sock_filter)BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ALLOW );
+    filter.push_back( insn );
+
+    insn = (struct sock_filter)BPF_STMT( BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr) );
+    filter.push_back( insn );
+    for( i = 0; i < count; i ++ ) {
+        if( syscallTable[ i ].pathArg < 0 && !syscallTable[ i ].changesDir ) continue;
+        if( preload && syscallTable[ i ].interposed ) continue;
+        insn = (struct sock_filter)BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, (__u32)syscallTable[ i ].id, 0, 1 );
+        filter.push_back( insn );
+        insn = (struct sock_filter)BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_TRACE );
+        filter.push_back( insn );
+    }
+    insn = (struct sock_filter)BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ALLOW );
+    filter.push_back( insn );
+
+    prog.len = filter.size();
+    prog.filter = &filter[ 0 ];
+
+    if( prctl( PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0 ) ) return false;
+    return !prctl( PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0 );
+}
+
+// Whether an ELF file asks for a dynamic loader
+template <class Ehdr, class Phdr> static bool elf_has_interp( int fd )
+{
+    Ehdr ehdr;
+    Phdr phdr;
+    int i;
+
+    if( pread( fd, &ehdr, sizeof(ehdr), 0 ) != sizeof(ehdr) ) return false;
+    for( i = 0; i < ehdr.e_phnum; i ++ ) {
+        if( pread( fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * ehdr.e_phentsize ) != sizeof(phdr) ) return false;
+        if( phdr.p_type == PT_INTERP ) return true;
+    }
+    return false;
+}
+
+// Whether a process that has just exec'd will load libptmake_preload.so. If
+// it is statically linked, or its environment has lost LD_PRELOAD, it has to
+// be traced with ptrace instead.
+static bool preload_loaded( pid_t child )
+{
+    char file[ 64 ];
+    unsigned char ident[ EI_NIDENT ];
+    bool preload = false, socket = false, interp = false;
+    string var;
+    int fd;
+
+    snprintf( file, sizeof(file), "/proc/%d/environ", (int)child );
+    ifstream environ( file );
+    while( getline( environ, var, '\0' ) ) {
+        if( !var.compare( 0, 11, "LD_PRELOAD=" ) && var.find( preloadLibrary ) != string::npos ) {
+            preload = true;
+        } else if( !var.compare( 0, strlen( PRELOAD_SOCKET_ENV "=" ), PRELOAD_SOCKET_ENV "=" ) ) {
+            socket = true;
+        }
+    }
+    if( !preload || !socket ) return false;
+
+    snprintf( file, sizeof(file), "/proc/%d/exe", (int)child );
+    fd = open( file, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ) return false;
+    if( pread( fd, ident, sizeof(ident), 0 ) == sizeof(ident) && !memcmp( ident, ELFMAG, SELFMAG ) ) {
+        if( ident[ EI_CLASS ] == ELFCLASS64 ) {
+            interp = elf_has_interp<Elf64_Ehdr, Elf64_Phdr>( fd );
+        } else {
+            interp = elf_has_interp<Elf32_Ehdr, Elf32_Phdr>( fd );
+        }
+    }
+    close( fd );
+    return interp;
+}
+
+// Per-thread tracing state, in a flat open addressed table keyed by tid.
+// Link steps can run hundreds of threads, each of which stops on every
+// traced call. Collisions are resolved by linear probing, and entries are
+// shifted back on deletion so there are no tombstones to skip.
+class TraceeTable
+{
+public:
+    TraceeTable( ) : count( 0 ), slots( 64 ) { }
+
+    /* The state of a thread, or NULL if it isn't in the table */
+    TraceeState *find( pid_t tid );
+
+    /* The state of a thread, added if it isn't in the table. This may move
+       every entry, so pointers returned earlier are no longer valid. */
+    TraceeState *insert( pid_t tid, bool *added );
+
+    void erase( pid_t tid );
+
+    size_t size( ) { return count; }
+
+    /* Every thread in the table */
+    void list( vector<pid_t> *tids );
+
+private:
+    struct Slot
+    {
+        Slot( ) : tid( 0 ) { }
+
+        pid_t tid;
+        TraceeState state;
+    };
+
+    size_t home( pid_t tid ) { return ((unsigned long)tid * 2654435761UL) & (slots.size() - 1); }
+    size_t lookup( pid_t tid );
+    void grow( );
+
+    size_t count;
+    vector<Slot> slots;
+};
+
+// The slot holding tid, or the empty slot where it would go
+size_t TraceeTable::lookup( pid_t tid )
+{
+    size_t i = home( tid );
+
+    while( slots[ i ].tid != 0 && slots[ i ].tid != tid ) {
+        i = (i + 1) & (slots.size() - 1);
+    }
+    return i;
+}
+
+TraceeState *TraceeTable::find( pid_t tid )
+{
+    size_t i = lookup( tid );
+
+    return slots[ i ].tid == tid ? &slots[ i ].state : NULL;
+}
+
+TraceeState *TraceeTable::insert( pid_t tid, bool *added )
+{
+    size_t i = lookup( tid );
+
+    *added = slots[ i ].tid == 0;
+    if( *added ) {
+        // Keep at least half the slots empty, so probes stay short
+        if( (count + 1) * 2 > slots.size() ) {
+            grow();
+            i = lookup( tid );
+        }
+        slots[ i ].tid = tid;
+        slots[ i ].state = TraceeState();
+        count ++;
+    }
+    return &slots[ i ].state;
+}
+
+void TraceeTable::erase( pid_t tid )
+{
+    size_t mask = slots.size() - 1;
+    size_t i = lookup( tid ), j, k;
+
+    if( slots[ i ].tid == 0 ) return;
+
+    // Move back any following entry that can't be found past the gap
+    for( j = (i + 1) & mask; slots[ j ].tid != 0; j = (j + 1) & mask ) {
+        k = home( slots[ j ].tid );
+        if( i <= j ? (i < k && k <= j) : (i < k || k <= j) ) continue;
+        slots[ i ].tid = slots[ j ].tid;
+        swap( slots[ i ].state, slots[ j ].state );
+        i = j;
+    }
+    slots[ i ].tid = 0;
+    slots[ i ].state = TraceeState();
+    count --;
+}
+
+void TraceeTable::list( vector<pid_t> *tids )
+{
+    for( size_t i = 0; i < slots.size(); i ++ ) {
+        if( slots[ i ].tid != 0 ) tids->push_back( slots[ i ].tid );
+    }
+}
+
+void TraceeTable::grow( )
+{
+    vector<Slot> old( slots.size() * 2 );
+    size_t i, j;
+
+    old.swap( slots );
+    for( i = 0; i < old.size(); i ++ ) {
+        if( old[ i ].tid == 0 ) continue;
+        j = lookup( old[ i ].tid );
+        slots[ j ].tid = old[ i ].tid;
+        swap( slots[ j ].state, old[ i ].state );
+    }
+}
+
+// The process or thread a new tracee was created by. A thread belongs to its
+// thread group, a process to its parent.
+static pid_t creator( pid_t child )
+{
+    char file[ 64 ];
+    string line;
+    pid_t tgid = 0, ppid = 0;
+
+    snprintf( file, sizeof(file), "/proc/%d/status", (int)child );
+    ifstream status( file );
+    while( getline( status, line ) ) {
+        if( !line.compare( 0, 5, "Tgid:" ) ) tgid = atoi( line.c_str() + 5 );
+        if( !line.compare( 0, 5, "PPid:" ) ) ppid = atoi( line.c_str() + 5 );
+    }
+    return tgid != child ? tgid : ppid;
+}
+
+// Recordings are the magic and the format version, then one record per
+// event. A record is the session, the length, the type and whether the path
+// exists, followed by length bytes of path, or of the command for
+// RECORD_START. Numbers are written least significant byte first, in 4
+// bytes for the version, session and length, and in 1 for the others. The
+// events of commands that ran at the same time are interleaved, and told
+// apart by session.
+#define RECORDING_MAGIC "ptmkrec1"
+#define RECORDING_VERSION 2
+#define RECORD_HEADER_SIZE 10
+
+enum {
+    RECORD_START,
+    RECORD_ENTRY,
+    RECORD_EXIT,
+    RECORD_DONE,
+    RECORD_WRITE,
+    RECORD_REMOVE
+};
+
+// An access read back from a recording
+struct RecordedEvent
+{
+    unsigned char type;
+    bool exists;
+    string path;
+};
+
+static ofstream recording;
+static unsigned int recordedSessions = 0;
+
+// The events of each recorded run of a command, by its command line, in the
+// order they were started
+static map<string, list<vector<RecordedEvent> > > recordings;
+
+static void put_number( char *buf, unsigned long n, size_t size )
+{
+    for( size_t i = 0; i < size; i ++ ) {
+        buf[ i ] = (char)(n >> (8 * i));
+    }
+}
+
+static unsigned long get_number( const char *buf, size_t size )
+{
+    unsigned long n = 0;
+
+    for( size_t i = 0; i < size; i ++ ) {
+        n |= (unsigned long)(unsigned char)buf[ i ] << (8 * i);
+    }
+    return n;
+}
+
+static void record( unsigned int session, int type, bool exists, const string &path )
+{
+    char h[ RECORD_HEADER_SIZE ];
+
+    put_number( h, session, 4 );
+    put_number( h + 4, path.length(), 4 );
+    put_number( h + 8, type, 1 );
+    put_number( h + 9, exists, 1 );
+    recording.write( h, sizeof(h) );
+    recording.write( path.data(), path.length() );
+}
+
+static void load_recording( const string &file )
+{
+    map<unsigned int, vector<RecordedEvent> *> running;
+    vector<RecordedEvent> *events;
+    char magic[ sizeof(RECORDING_MAGIC) - 1 ], version[ 4 ], h[ RECORD_HEADER_SIZE ];
+    unsigned long session, length;
+    RecordedEvent e;
+    string s;
+
+    ifstream in( file.c_str(), ios::binary );
+    if( !in.read( magic, sizeof(magic) ) || memcmp( magic, RECORDING_MAGIC, sizeof(magic) ) ) {
+        throw runtime_wexception( "Not a recording: " + file );
+    }
+    if( !in.read( version, sizeof(version) ) || get_number( version, sizeof(version) ) != RECORDING_VERSION ) {
+        throw runtime_wexception( "Recording in an unsupported format: " + file );
+    }
+
+    // Only the end of a record can be the end of the file
+    while( in.read( h, sizeof(h) ) ) {
+        session = get_number( h, 4 );
+        length = get_number( h + 4, 4 );
+        e.type = get_number( h + 8, 1 );
+        e.exists = get_number( h + 9, 1 );
+        if( length > (e.type == RECORD_START ? (unsigned long)sysconf( _SC_ARG_MAX ) : PATH_MAX) ) {
+            throw runtime_wexception( "Corrupt recording: " + file );
+        }
+        s.resize( length );
+        if( length > 0 && !in.read( &s[ 0 ], length ) ) {
+            throw runtime_wexception( "Corrupt recording: " + file );
+        }
+
+        if( e.type == RECORD_START ) {
+            list<vector<RecordedEvent> > &runs = recordings[ s ];
+            runs.push_back( vector<RecordedEvent>() );
+            running[ session ] = &runs.back();
+            continue;
+        }
+        if( running.find( session ) == running.end() ) {
+            throw runtime_wexception( "Corrupt recording: " + file );
+        }
+        events = running[ session ];
+        if( e.type == RECORD_DONE ) {
+            running.erase( session );
+        } else {
+            e.path.swap( s );
+            events->push_back( e );
+        }
+    }
+    if( in.gcount() != 0 ) {
+        throw runtime_wexception( "Corrupt recording: " + file );
+    }
+}
+
+// A command being traced, from its launch until every process it started has
+// finished
+struct TraceSession
+{
+    Subprocess *owner;
+    string command;
+    // How it's traced, as set when it was started
+    TraceMode mode;
+    bool entryOnly;
+    // The thread tracing it, or NULL for the main thread. Its tracees are
+    // only touched by that thread, until it hands the command back.
+    struct Tracer *tracer;
+    bool handedBack;
+    // The command's first process. Once it has exited, whatever it left
+    // running is let go of rather than waited for.
+    pid_t pid;
+    bool detaching;
+    TraceeTable tracees;
+    class PreloadServer *server;
+    // In entry only mode, the paths looked up, to check once it's finished
+    set<string> unchecked;
+    // Processes and threads that exited before their creator's event
+    set<pid_t> vanished;
+    // Where it was started, and the dependency file it reports its
+    // dependencies in when they're not traced
+    string cwd;
+    string depfile;
+    // Accesses held up by a callback. The command isn't finished until
+    // they've been let go, even if their processes have been killed.
+    unsigned int parked;
+    struct timeval start, launched;
+    unsigned long stops;
+    // The rule it's counted against with --stats-by-rule
+    StatsRule *stats;
+    // Its number in the recording
+    unsigned int id;
+    // When replaying, what the command did, or before it's launched, the
+    // search for its program, and how far it's got. It stalls while an
+    // entry is parked.
+    vector<RecordedEvent> replay;
+    size_t replayed;
+    bool stalled;
+    // Set until it has been launched, with what to launch and how to trace it
+    bool launchPending;
+    string program;
+    vector<string> args;
+    long options;
+};
+
+// Every command being traced. A callback can start another command while the
+// first one is still running, and waitid() returns events for all of them.
+static list<TraceSession *> sessions;
+
+// What commands traced on this thread left running once they exited, still
+// traced but not reported, or NULL
+static __thread TraceSession *released = NULL;
+
+// The access callback_entry is being called for, which it can park. A tid
+// of -1 is for an access that wasn't held, and so can't be.
+static TraceSession *currentSession = NULL;
+static const string *currentPath;
+static pid_t currentTid;
+static int currentFd;
+static bool parkRequested;
+
+struct ParkedAccess
+{
+    TraceSession *session;
+    // A traced thread, or a connection from the preload library, or
+    // neither for a replayed access
+    pid_t tid;
+    int fd;
+    // When it was held, with --stats
+    unsigned long long since;
+};
+
+// What the main thread asks of a tracer thread
+struct TracerRequest
+{
+    enum {
+        // Start tracing a command's first process
+        SEIZE,
+        // Let a thread held at the entry to an access go on
+        RESUME,
+        // Stop holding threads at the entry to accesses to path
+        SETTLE
+    } type;
+    TraceSession *session;
+    unsigned int id;
+    pid_t pid;
+    long options;
+    string path;
+    // For a seize, set to 1 once done, or 0 if it failed
+    int *result;
+};
+
+// An access a tracer thread has handed over to the main thread. RECORD_DONE
+// hands the command back once its processes have all gone. An entry whose
+// thread wasn't held has a tid of -1.
+struct HandedEvent
+{
+    TraceSession *session;
+    pid_t tid;
+    unsigned char type;
+    bool exists;
+    string path;
+};
+
+// The accesses a tracer hands over, written only by the tracer and read only
+// by the main thread, so neither takes a lock for each one
+class HandedRing
+{
+public:
+    HandedRing( ) : head( 0 ), tail( 0 ) { }
+
+    /* Add an event, taking its contents. Returns false if the ring is full,
+     * and otherwise sets wasEmpty if the main thread could have found it
+     * empty before and be waiting.
+     */
+    bool push( HandedEvent &e, bool *wasEmpty );
+
+    /* Take the oldest event. Returns false if there is none. */
+    bool pop( HandedEvent *e );
+
+private:
+    enum { SIZE = 4096 };
+
+    HandedEvent slots[ SIZE ];
+    // The next slot to read, advanced by the main thread, and the next to
+    // write, advanced by the tracer
+    size_t head, tail;
+};
+
+// The index each side advances is stored, and then the other side's loaded,
+// both sequentially consistent. So when the main thread finds the ring empty
+// and goes to wait, the tracer adding to it after sees the ring was empty and
+// wakes it.
+bool HandedRing::push( HandedEvent &e, bool *wasEmpty )
+{
+    size_t t = tail;
+
+    if( t - __atomic_load_n( &head, __ATOMIC_SEQ_CST ) == SIZE ) return false;
+    swap( slots[ t % SIZE ], e );
+    __atomic_store_n( &tail, t + 1, __ATOMIC_SEQ_CST );
+    *wasEmpty = __atomic_load_n( &head, __ATOMIC_SEQ_CST ) == t;
+    return true;
+}
+
+bool HandedRing::pop( HandedEvent *e )
+{
+    size_t h = head;
+
+    if( __atomic_load_n( &tail, __ATOMIC_SEQ_CST ) == h ) return false;
+    swap( *e, slots[ h % SIZE ] );
+    __atomic_store_n( &head, h + 1, __ATOMIC_SEQ_CST );
+    return true;
+}
+
+// A thread that services the ptrace stops of some of the commands, so more
+// stops can be handled at once than one thread keeps up with. ptrace only
+// takes requests from the thread that seized a process, so a command stays
+// with its tracer until every process it started has gone. The callbacks
+// still run on the main thread: the tracer hands accesses over in order, and
+// holds a thread at the entry to an access until the main thread lets it go,
+// unless the path is one no command is held on any more.
+struct Tracer
+{
+    pthread_t thread;
+    unsigned int number;
+    // Written to on every SIGCHLD, and with every request that can't wait
+    int wake[ 2 ];
+    pthread_mutex_t lock;
+    pthread_cond_t seized;
+    list<TracerRequest> requests;
+    HandedRing handed;
+    // Set by the tracer once the ring has filled up, so the main thread
+    // wakes it when there's room again
+    bool full;
+    // Only touched by the thread: the commands it's tracing, what didn't
+    // fit in the ring, in order, and the paths accesses aren't held on
+    list<TraceSession *> sessions;
+    list<HandedEvent> overflow;
+    set<string> settled;
+    // The commands handed to it and not yet handed back, only touched by the
+    // main thread
+    unsigned int running;
+    // How many stops it has handled, and the time it was busy, in
+    // microseconds. Written by the thread, and read by the main thread.
+    unsigned long stops;
+    unsigned long busy;
+    struct timeval started;
+};
+
+static vector<Tracer *> tracers;
+
+// The tracer the calling thread is, or NULL on the main thread
+static __thread Tracer *currentTracer = NULL;
+
+// Written to when a tracer adds to its ring while the main thread may be
+// waiting
+static int handedPipe[ 2 ] = { -1, -1 };
+
+// Move what overflowed the ring into it, as far as there's room
+static void flush_overflow( Tracer *t )
+{
+    bool wasEmpty = false, wake = false;
+    ssize_t ret;
+
+    while( !t->overflow.empty() ) {
+        if( !t->handed.push( t->overflow.front(), &wasEmpty ) ) {
+            // Ask to be woken once there's room, then check the main thread
+            // hasn't just made some
+            __atomic_store_n( &t->full, true, __ATOMIC_SEQ_CST );
+            if( !t->handed.push( t->overflow.front(), &wasEmpty ) ) break;
+        }
+        t->overflow.pop_front();
+        wake = wake || wasEmpty;
+    }
+    if( wake ) {
+        ret = write( handedPipe[ 1 ], "", 1 );
+        (void)ret;
+    }
+}
+
+static void hand_over( TraceSession *session, pid_t tid, int type, bool exists, const string &path )
+{
+    Tracer *t = currentTracer;
+    HandedEvent e;
+    bool wasEmpty;
+    ssize_t ret;
+
+    e.session = session;
+    e.tid = tid;
+    e.type = type;
+    e.exists = exists;
+    e.path = path;
+
+    // Kept in order behind anything that didn't fit
+    if( !t->overflow.empty() || !t->handed.push( e, &wasEmpty ) ) {
+        t->overflow.push_back( e );
+        flush_overflow( t );
+    } else if( wasEmpty ) {
+        ret = write( handedPipe[ 1 ], "", 1 );
+        (void)ret;
+    }
+}
+
+static void send_request( Tracer *t, const TracerRequest &r, bool wake = true )
+{
+    ssize_t ret;
+
+    pthread_mutex_lock( &t->lock );
+    t->requests.push_back( r );
+    pthread_mutex_unlock( &t->lock );
+    if( wake ) {
+        ret = write( t->wake[ 1 ], "", 1 );
+        (void)ret;
+    }
+}
+
+// Take the next access any tracer has handed over. Tracers are taken in turn,
+// as the order only matters within each command.
+static bool take_handed( HandedEvent *e )
+{
+    static size_t next = 0;
+    ssize_t ret;
+    Tracer *t;
+
+    for( size_t i = 0; i < tracers.size(); i ++ ) {
+        t = tracers[ (next + i) % tracers.size() ];
+        if( !t->handed.pop( e ) ) continue;
+        next = (next + i + 1) % tracers.size();
+        if( __atomic_exchange_n( &t->full, false, __ATOMIC_SEQ_CST ) ) {
+            ret = write( t->wake[ 1 ], "", 1 );
+            (void)ret;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Call callback_entry for an access by a traced thread, or over a connection
+// from the preload library. Returns whether the callback parked it. On a
+// tracer thread, the access is handed over, and held until it's let go
+// unless its path has been settled.
+static bool entry_callback( TraceSession *session, pid_t tid, int fd, const string &path )
+{
+    TraceSession *savedSession = currentSession;
+    const string *savedPath = currentPath;
+    pid_t savedTid = currentTid;
+    int savedFd = currentFd;
+    bool savedPark = parkRequested, parked;
+
+    if( currentTracer != NULL ) {
+        parked = !currentTracer->settled.count( path );
+        hand_over( session, parked ? tid : -1, RECORD_ENTRY, false, path );
+        return parked;
+    }
+
+    if( recording.is_open() ) record( session->id, RECORD_ENTRY, false, path );
+
+    // Counted as parked while the callback runs, so the session isn't
+    // finished under it if the callback waits for other commands
+    session->parked ++;
+    currentSession = session;
+    currentPath = &path;
+    currentTid = tid;
+    currentFd = fd;
+    parkRequested = false;
+    session->owner->callback_entry( path );
+    parked = parkRequested;
+
+    currentSession = savedSession;
+    currentPath = savedPath;
+    currentTid = savedTid;
+    currentFd = savedFd;
+    parkRequested = savedPark;
+
+    if( !parked ) session->parked --;
+    return parked;
+}
+
+static void exit_callback( TraceSession *session, const string &path, bool exists )
+{
+    if( currentTracer != NULL ) {
+        hand_over( session, 0, RECORD_EXIT, exists, path );
+        return;
+    }
+    if( recording.is_open() ) record( session->id, RECORD_EXIT, exists, path );
+    session->owner->callback_exit( path, exists );
+}
+
+// Tell the owner a command created, wrote or removed a path
+static void write_callback( TraceSession *session, const string &path, bool removed )
+{
+    if( currentTracer != NULL ) {
+        hand_over( session, 0, removed ? RECORD_REMOVE : RECORD_WRITE, false, path );
+        return;
+    }
+    if( recording.is_open() ) record( session->id, removed ? RECORD_REMOVE : RECORD_WRITE, false, path );
+    session->owner->callback_write( path, removed );
+}
+
+// Report the existing files a program was given as arguments, for a tool
+// whose accesses are otherwise ignored. Options and anything that isn't a
+// regular file, such as an output not yet written, are left out.
+static void report_arguments( TraceSession *session, const string &cwd, const vector<string> &args )
+{
+    struct stat st;
+    string path;
+
+    for( size_t i = 1; i < args.size(); i ++ ) {
+        if( args[ i ].empty() || args[ i ][ 0 ] == '-' ) continue;
+        path = args[ i ];
+        absolute_path( cwd, &path );
+        if( excluded( path ) ) continue;
+        stats_add( STAT_STAT );
+        if( !stat( path.c_str(), &st ) && S_ISREG( st.st_mode ) ) {
+            exit_callback( session, path, true );
+        }
+    }
+}
+
+// The command an event is for: it's for one of its tracees, or a new process
+// or thread one of them created whose fork or clone event we haven't seen yet
+static TraceSession *find_session( const list<TraceSession *> &traced, const siginfo_t &info )
+{
+    list<TraceSession *>::const_iterator i;
+    pid_t parent;
+
+    for( i = traced.begin(); i != traced.end(); i ++ ) {
+        if( (*i)->tracer == currentTracer && (*i)->tracees.find( info.si_pid ) != NULL ) return *i;
+    }
+    if( released != NULL && released->tracees.find( info.si_pid ) != NULL ) return released;
+    if( info.si_code != CLD_TRAPPED && info.si_code != CLD_STOPPED ) return NULL;
+
+    parent = creator( info.si_pid );
+    for( i = traced.begin(); i != traced.end(); i ++ ) {
+        if( (*i)->tracer == currentTracer && (*i)->tracees.find( parent ) != NULL ) return *i;
+    }
+    if( released != NULL && released->tracees.find( parent ) != NULL ) return released;
+    return NULL;
+}
+
+// Wait for the next event for any tracee of the calling thread. Returns 0 if
+// there is none yet and we're not to block, -1 once there are no children
+// left.
+static int next_event( bool block, siginfo_t *info )
+{
+    while( 1 ) {
+        info->si_pid = 0;
+        if( waitid( P_ALL, 0, info, WEXITED | WSTOPPED | __WALL | __WNOTHREAD | (block ? 0 : WNOHANG) ) ) {
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        return info->si_pid != 0;
+    }
+}
+
+static void sigchld_handler( int )
+{
+    int saved = errno;
+    ssize_t ret;
+
+    ret = write( sigchldPipe[ 1 ], "", 1 );
+    // It isn't known whose tracee it was, so every tracer checks
+    for( size_t i = 0; i < tracers.size(); i ++ ) {
+        ret = write( tracers[ i ]->wake[ 1 ], "", 1 );
+    }
+    (void)ret;
+    errno = saved;
+}
+
+// Have SIGCHLD written to sigchldPipe, and to the tracer threads. Set up
+// once, and left for every later server.
+static void watch_sigchld( )
+{
+    struct sigaction action;
+
+    if( sigchldPipe[ 0 ] >= 0 ) return;
+    if( pipe2( sigchldPipe, O_CLOEXEC | O_NONBLOCK ) ) {
+        throw runtime_wexception( "Could not create pipe" );
+    }
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = sigchld_handler;
+    // Without SA_NOCLDSTOP, so ptrace stops are signalled too
+    action.sa_flags = SA_RESTART;
+    sigaction( SIGCHLD, &action, NULL );
+}
+
+// Receives the accesses reported by libptmake_preload.so (see preload.h) and
+// passes them to the same callbacks as the ptrace stops
+class PreloadServer
+{
+public:
+    PreloadServer( TraceSession *session );
+    ~PreloadServer( );
+
+    /* The socket name to give traced commands */
+    const string &getName( ) { return name; }
+
+    /* Add what there is to poll for to fds */
+    void fill( vector<struct pollfd> &fds );
+
+    /* Handle what poll found, in the entries fill added from first up to
+       last */
+    void handle( const vector<struct pollfd> &fds, size_t first, size_t last );
+
+    /* Handle whatever is left once the command has finished */
+    void drain( );
+
+    /* Let a connection parked by a callback go on */
+    void resume( int fd );
+
+private:
+    struct Connection
+    {
+        Connection( ) : parked( false ), ignored( false ) { }
+
+        int fd;
+        string buffer;
+        // Waiting for its last access to be let go, or for the callback
+        // for it to return, so nothing more is handled from it until then
+        bool parked;
+        // From a process whose tool policy leaves its accesses unreported
+        bool ignored;
+    };
+
+    /* Read from a connection. Returns false once it's closed */
+    bool receive( Connection &c );
+
+    /* Handle the complete records read from a connection */
+    void process( Connection &c );
+
+    /* Whether the process at the other end of a connection is ignored */
+    bool ignored_peer( int fd );
+
+    TraceSession *session;
+    int listenFd;
+    string name;
+    list<Connection> connections;
+};
+
+PreloadServer::PreloadServer( TraceSession *session ) : session( session )
+{
+    static unsigned int count = 0;
+    struct sockaddr_un addr;
+    stringstream ss;
+
+    watch_sigchld();
+
+    ss << "ptmake-" << getpid() << "-" << count ++;
+    name = ss.str();
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    memcpy( addr.sun_path + 1, name.c_str(), name.length() );
+
+    listenFd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+    if( listenFd < 0
+            || bind( listenFd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + name.length() )
+            || listen( listenFd, 64 ) ) {
+        throw runtime_wexception( "Could not create preload socket" );
+    }
+}
+
+PreloadServer::~PreloadServer( )
+{
+    for( list<Connection>::iterator i = connections.begin(); i != connections.end(); i ++ ) {
+        close( i->fd );
+    }
+    close( listenFd );
+}
+
+void PreloadServer::fill( vector<struct pollfd> &fds )
+{
+    list<Connection>::iterator i;
+    struct pollfd fd;
+
+    fd.events = POLLIN;
+    fd.revents = 0;
+    fd.fd = listenFd;
+    fds.push_back( fd );
+    for( i = connections.begin(); i != connections.end(); i ++ ) {
+        // poll skips negative descriptors
+        fd.fd = i->parked ? -1 : i->fd;
+        fds.push_back( fd );
+    }
+}
+
+void PreloadServer::handle( const vector<struct pollfd> &fds, size_t first, size_t last )
+{
+    list<Connection>::iterator i;
+    set<int> ready;
+    size_t j;
+
+    // Matched up by descriptor, as callbacks for other commands can have
+    // come and gone through this server since it was polled
+    for( j = first + 1; j < last; j ++ ) {
+        if( fds[ j ].revents ) ready.insert( fds[ j ].fd );
+    }
+
+    // Handle the connections we polled before accepting new ones
+    for( i = connections.begin(); i != connections.end(); ) {
+        if( !i->parked && ready.count( i->fd ) && !receive( *i ) ) {
+            close( i->fd );
+            i = connections.erase( i );
+        } else {
+            i ++;
+        }
+    }
+
+    if( fds[ first ].revents ) {
+        Connection c;
+
+        while( (c.fd = accept4( listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK )) >= 0 ) {
+            c.ignored = ignored_peer( c.fd );
+            connections.push_back( c );
+        }
+    }
+}
+
+void PreloadServer::drain( )
+{
+    vector<struct pollfd> fds;
+
+    while( 1 ) {
+        fds.clear();
+        fill( fds );
+        if( ::poll( &fds[ 0 ], fds.size(), 0 ) <= 0 ) break;
+        handle( fds, 0, fds.size() );
+    }
+}
+
+void PreloadServer::resume( int fd )
+{
+    list<Connection>::iterator i;
+
+    for( i = connections.begin(); i != connections.end(); i ++ ) {
+        if( i->fd == fd && i->parked ) {
+            i->parked = false;
+            while( send( i->fd, "", 1, MSG_NOSIGNAL ) < 0 && errno == EINTR );
+            process( *i );
+            break;
+        }
+    }
+}
+
+bool PreloadServer::receive( Connection &c )
+{
+    char buf[ 4096 ];
+    ssize_t n;
+
+    n = recv( c.fd, buf, sizeof(buf), 0 );
+    if( n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR) ) return false;
+    if( n > 0 ) c.buffer.append( buf, n );
+
+    process( c );
+    return true;
+}
+
+bool PreloadServer::ignored_peer( int fd )
+{
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    TraceeState *state;
+
+    if( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &cred, &length ) ) return false;
+    // The process execs with ptrace, so its exec event has been handled by
+    // the time it connects, but a new one's fork event can still be due
+    state = session->tracees.find( cred.pid );
+    if( state == NULL ) state = session->tracees.find( creator( cred.pid ) );
+    return state != NULL && state->ignored;
+}
+
+void PreloadServer::process( Connection &c )
+{
+    struct preload_record r;
+    string path;
+    bool skip;
+
+    while( !c.parked && c.buffer.length() >= sizeof(r) ) {
+        memcpy( &r, c.buffer.data(), sizeof(r) );
+        if( c.buffer.length() < sizeof(r) + r.length ) break;
+
+        // Exclusions apply to the path as the program gave it, as they do
+        // for traced calls, so most excluded paths aren't copied out, and
+        // to where a relative one leads
+        skip = c.ignored || r.relative >= r.length
+            || exclusions.excluded( c.buffer.data() + sizeof(r) + r.relative, r.length - r.relative );
+        if( !skip ) {
+            path = c.buffer.substr( sizeof(r), r.length );
+            absolute_path( "", &path );
+            skip = excluded( path );
+        }
+        c.buffer.erase( 0, sizeof(r) + r.length );
+
+        if( r.type == PRELOAD_ENTRY ) {
+            if( !skip ) {
+                if( session->entryOnly ) session->unchecked.insert( path );
+                // The ack is sent when it's let go
+                c.parked = true;
+                c.parked = entry_callback( session, 0, c.fd, path );
+                if( c.parked ) break;
+            }
+            // Let the process go on with the access
+            while( send( c.fd, "", 1, MSG_NOSIGNAL ) < 0 && errno == EINTR );
+        } else if( r.type == PRELOAD_EXIT ) {
+            if( !session->entryOnly && !skip ) exit_callback( session, path, r.exists );
+        } else if( !skip ) {
+            write_callback( session, path, r.type == PRELOAD_REMOVE );
+        }
+    }
+}
+
+// Wait for an access to be reported to any preload server or handed over by
+// a tracer thread, or for a process traced by the main thread to change state
+static void wait_servers( )
+{
+    vector<struct pollfd> fds;
+    vector<PreloadServer *> polled;
+    vector<size_t> ranges;
+    list<TraceSession *>::iterator i;
+    struct pollfd fd;
+    char buf[ 64 ];
+    size_t j;
+    bool traced = false;
+
+    // The tracer threads' stops are signalled too, so SIGCHLD is only
+    // watched for while the main thread has processes of its own
+    for( i = sessions.begin(); i != sessions.end(); i ++ ) {
+        if( (*i)->tracer == NULL ) traced = true;
+    }
+    fd.fd = traced ? sigchldPipe[ 0 ] : -1;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    fds.push_back( fd );
+    fd.fd = handedPipe[ 0 ];
+    fds.push_back( fd );
+    for( i = sessions.begin(); i != sessions.end(); i ++ ) {
+        if( (*i)->server == NULL ) continue;
+        polled.push_back( (*i)->server );
+        ranges.push_back( fds.size() );
+        (*i)->server->fill( fds );
+    }
+    ranges.push_back( fds.size() );
+
+    if( ::poll( &fds[ 0 ], fds.size(), -1 ) <= 0 ) return;
+
+    if( fds[ 0 ].revents ) {
+        while( read( sigchldPipe[ 0 ], buf, sizeof(buf) ) > 0 );
+    }
+    if( fds[ 1 ].revents ) {
+        while( read( handedPipe[ 0 ], buf, sizeof(buf) ) > 0 );
+    }
+    // Callbacks can start and finish other commands, so only servers that
+    // are still there are handled
+    for( j = 0; j < polled.size(); j ++ ) {
+        for( i = sessions.begin(); i != sessions.end() && (*i)->server != polled[ j ]; i ++ );
+        if( i != sessions.end() ) polled[ j ]->handle( fds, ranges[ j ], ranges[ j + 1 ] );
+    }
+}
+
+// Run a command in a new process once a byte arrives on go, which is sent
+// once it has been seized - without PTRACE_O_TRACESECCOMP, filtered system
+// calls fail with ENOSYS
+static void run_command( int go, TraceMode mode, const string &program, const vector<string> &args, const vector<string> &env )
+{
+    vector<string>::const_iterator i;
+    vector<char *> argv;
+    size_t equals;
+    char c;
+
+    for( i = env.begin(); i != env.end(); i ++ ) {
+        equals = i->find( '=' );
+        setenv( i->substr( 0, equals ).c_str(), i->c_str() + equals + 1, 1 );
+    }
+    for( i = args.begin(); i != args.end(); i ++ ) {
+        argv.push_back( (char *)i->c_str() );
+    }
+    argv.push_back( NULL );
+
+    if( read( go, &c, 1 ) != 1 ) _exit(127);
+    if( (mode == TRACE_SECCOMP || mode == TRACE_PRELOAD) && !install_seccomp_filter( mode == TRACE_PRELOAD ) ) {
+        cerr << "Could not install seccomp filter" << endl;
+        _exit(127);
+    }
+    execv( program.c_str(), &argv[ 0 ] );
+    cerr << args[ 0 ] << ": " << strerror( errno ) << endl;
+    _exit( errno == ENOENT ? 127 : 126 );
+}
+
+// Commands are launched from a process forked before the makefile is read,
+// so each launch copies its small address space rather than ours. Requests
+// are one message each: the number of arguments, the trace mode, the program,
+// the arguments and the environment settings, all NUL terminated, with the
+// read end of the
+// go pipe passed alongside. It answers with the pid it started.
+static void zygote_main( int sock )
+{
+    vector<string> fields, args, env;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[ CMSG_SPACE( sizeof(int) ) ];
+    ssize_t n;
+    size_t start, end, count;
+    int go;
+    pid_t child;
+
+    // Nothing here waits for the commands, the kernel reaps them once their
+    // tracer is done with them
+    signal( SIGCHLD, SIG_IGN );
+    prctl( PR_SET_PDEATHSIG, SIGKILL );
+
+    for( ;; ) {
+        n = recv( sock, NULL, 0, MSG_PEEK | MSG_TRUNC );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) _exit(0);
+
+        vector<char> buf( n );
+        iov.iov_base = &buf[ 0 ];
+        iov.iov_len = n;
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if( recvmsg( sock, &msg, MSG_CMSG_CLOEXEC ) != n ) _exit(0);
+        cmsg = CMSG_FIRSTHDR( &msg );
+        if( cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ) _exit(0);
+        memcpy( &go, CMSG_DATA( cmsg ), sizeof(go) );
+
+        fields.clear();
+        for( start = 0; start < buf.size(); start = end + 1 ) {
+            end = start;
+            while( end < buf.size() && buf[ end ] != 0 ) end ++;
+            fields.push_back( string( &buf[ start ], end - start ) );
+        }
+        count = fields.size() >= 3 ? strtoul( fields[ 0 ].c_str(), NULL, 10 ) : 0;
+        if( count < 1 || count + 3 > fields.size() ) {
+            child = -1;
+        } else {
+            args.assign( fields.begin() + 3, fields.begin() + 3 + count );
+            env.assign( fields.begin() + 3 + count, fields.end() );
+            child = fork();
+            if( child == 0 ) {
+                close( sock );
+                signal( SIGCHLD, SIG_DFL );
+                run_command( go, (TraceMode)atoi( fields[ 1 ].c_str() ), fields[ 2 ], args, env );
+            }
+        }
+        close( go );
+        send( sock, &child, sizeof(child), MSG_NOSIGNAL );
+    }
+}
+
+// Ask the zygote to start a command. Returns -1 if it couldn't, and the
+// command should be forked from here instead.
+static pid_t zygote_launch( int go, TraceMode mode, const string &program, const vector<string> &args, const vector<string> &env )
+{
+    vector<string>::const_iterator i;
+    ostringstream request;
+    string buf;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[ CMSG_SPACE( sizeof(int) ) ];
+    pid_t child;
+
+    request << args.size() << '\0' << (int)mode << '\0' << program << '\0';
+    for( i = args.begin(); i != args.end(); i ++ ) request << *i << '\0';
+    for( i = env.begin(); i != env.end(); i ++ ) request << *i << '\0';
+    buf = request.str();
+
+    iov.iov_base = (void *)buf.data();
+    iov.iov_len = buf.length();
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof(int) );
+    memcpy( CMSG_DATA( cmsg ), &go, sizeof(go) );
+
+    if( sendmsg( zygoteSocket, &msg, MSG_NOSIGNAL ) < 0 ) {
+        // Too long for one message is worth a fork, anything else means
+        // the zygote has gone
+        if( errno != EMSGSIZE ) {
+            close( zygoteSocket );
+            zygoteSocket = -1;
+        }
+        return -1;
+    }
+    while( recv( zygoteSocket, &child, sizeof(child), 0 ) != sizeof(child) ) {
+        if( errno != EINTR ) {
+            close( zygoteSocket );
+            zygoteSocket = -1;
+            return -1;
+        }
+    }
+    return child;
+}
+
+// Start a command, which waits to be told to go on through the pipe. Sets
+// forked if it's a child of the calling thread.
+static pid_t launch( int pipefd[ 2 ], TraceMode mode, const string &program, const vector<string> &args, const vector<string> &env, bool *forked )
+{
+    pid_t child = -1;
+
+    *forked = false;
+    if( zygoteSocket >= 0 ) {
+        child = zygote_launch( pipefd[ 0 ], mode, program, args, env );
+        if( child > 0 ) return child;
+    }
+
+    *forked = true;
+    child = fork();
+    if( child == 0 ) {
+        close( pipefd[ 1 ] );
+        run_command( pipefd[ 0 ], mode, program, args, env );
+    }
+    return child;
+}
+
+// Attach to a command's first process, and stop it straight away so a fully
+// traced command is seen from its exec
+static bool seize( TraceSession *s, pid_t child, long options )
+{
+    TraceeState *state;
+    bool added;
+
+    if( ptrace( PTRACE_SEIZE, child, NULL, options ) ) return false;
+    ptrace( PTRACE_INTERRUPT, child, NULL, NULL );
+    s->pid = child;
+    state = s->tracees.insert( child, &added );
+    state->fullTrace = s->mode == TRACE_SYSCALL;
+    state->announced = true;
+    state->cwd = s->cwd;
+    return true;
+}
+
+// Have a tracer thread seize a command, and wait until it has
+static bool seize_on_tracer( TraceSession *s, pid_t child, long options )
+{
+    TracerRequest r;
+    Tracer *t = s->tracer;
+    int result = -1;
+
+    r.type = TracerRequest::SEIZE;
+    r.session = s;
+    r.id = s->id;
+    r.pid = child;
+    r.options = options;
+    r.result = &result;
+    send_request( t, r );
+
+    pthread_mutex_lock( &t->lock );
+    while( result < 0 ) pthread_cond_wait( &t->seized, &t->lock );
+    pthread_mutex_unlock( &t->lock );
+    return result;
+}
+
+// Let a thread held at the entry to an access go on. It may have been killed
+// while it was held.
+static void resume_tracee( TraceSession *s, pid_t tid )
+{
+    TraceeState *state = s->tracees.find( tid );
+
+    // It can have been let go of with the rest of what the command left
+    if( state == NULL && released != NULL ) state = released->tracees.find( tid );
+    if( state != NULL && state->parked ) {
+        state->parked = false;
+        ptrace( state->resume, tid, NULL, NULL );
+    }
+}
+
+// The tracer thread to give a new command to: the one with the fewest
+// commands, and of those the one that has handled the fewest stops. A
+// command can't move once it's seized, so this is all the balancing done.
+static Tracer *pick_tracer( )
+{
+    Tracer *best = tracers[ 0 ];
+
+    for( size_t i = 1; i < tracers.size(); i ++ ) {
+        Tracer *t = tracers[ i ];
+
+        if( t->running < best->running || (t->running == best->running
+                && __atomic_load_n( &t->stops, __ATOMIC_RELAXED ) < __atomic_load_n( &best->stops, __ATOMIC_RELAXED )) ) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static void *tracer_main( void *arg );
+
+// Start the tracer threads, and the pipe they hand accesses over on
+static void start_tracers( )
+{
+    Tracer *t;
+
+    if( pipe2( handedPipe, O_CLOEXEC | O_NONBLOCK ) ) {
+        throw runtime_wexception( "Could not create pipe" );
+    }
+    for( unsigned int i = 0; i < tracerCount; i ++ ) {
+        t = new Tracer;
+        t->number = i;
+        t->running = 0;
+        t->stops = 0;
+        t->busy = 0;
+        gettimeofday( &t->started, NULL );
+        pthread_mutex_init( &t->lock, NULL );
+        pthread_cond_init( &t->seized, NULL );
+        if( pipe2( t->wake, O_CLOEXEC | O_NONBLOCK ) || pthread_create( &t->thread, NULL, tracer_main, t ) ) {
+            throw runtime_wexception( "Could not start a tracer thread" );
+        }
+        pthread_detach( t->thread );
+        tracers.push_back( t );
+    }
+    // Only once they're all there, as the handler goes through them
+    watch_sigchld();
+}
+
+void subprocess_report( ostream &out )
+{
+    struct timeval now;
+    double elapsed;
+
+    gettimeofday( &now, NULL );
+    for( size_t i = 0; i < tracers.size(); i ++ ) {
+        Tracer *t = tracers[ i ];
+        unsigned long stops = __atomic_load_n( &t->stops, __ATOMIC_RELAXED );
+        unsigned long busy = __atomic_load_n( &t->busy, __ATOMIC_RELAXED );
+
+        elapsed = (now.tv_sec - t->started.tv_sec) + (now.tv_usec - t->started.tv_usec) / 1000000.0;
+        out << "Tracer " << t->number << ": " << stops << " stops, "
+            << (elapsed > 0 ? stops / elapsed : 0) << " stops/s, "
+            << (busy > 0 ? stops / (busy / 1000000.0) : 0) << " stops/s busy, "
+            << (elapsed > 0 ? busy / elapsed / 10000.0 : 0) << "% busy" << endl;
+    }
+
+    out << "Stops by system call (entry, exit):" << endl;
+    for( size_t i = 0; i <= sizeof(syscallTable)/sizeof(syscallTable[0]); i ++ ) {
+        unsigned long entry = __atomic_load_n( &syscallStops[ i ][ 0 ], __ATOMIC_RELAXED );
+        unsigned long exit = __atomic_load_n( &syscallStops[ i ][ 1 ], __ATOMIC_RELAXED );
+
+        if( entry == 0 && exit == 0 ) continue;
+        out << "  " << (i < sizeof(syscallTable)/sizeof(syscallTable[0]) ? syscallTable[ i ].name : "other")
+            << ": " << entry << ", " << exit << endl;
+    }
+}
+
+void subprocess_start( )
+{
+    int sv[ 2 ];
+    pid_t pid;
+
+    // Nothing is run when replaying
+    if( !replayFile.empty() ) {
+        load_recording( replayFile );
+        return;
+    }
+
+    // Seccomp is the default, and falls back as it does when asked for
+    if( !traceModeChecked ) Subprocess::setTraceMode( TRACE_SECCOMP );
+
+    if( !launchChosen ) useZygote = tracerCount > 0;
+    if( useZygote && !socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv ) ) {
+        // Anything buffered would be written again by the zygote
+        cout.flush();
+        pid = fork();
+        if( pid == 0 ) {
+            close( sv[ 0 ] );
+            zygote_main( sv[ 1 ] );
+        }
+        close( sv[ 1 ] );
+        if( pid < 0 ) {
+            close( sv[ 0 ] );
+        } else {
+            zygoteSocket = sv[ 0 ];
+        }
+    }
+
+    // Opened after the fork, so the zygote has no buffer of it to write
+    if( !recordFile.empty() ) {
+        recording.open( recordFile.c_str(), ios::binary | ios::trunc );
+        if( !recording ) {
+            throw runtime_wexception( "Could not create " + recordFile );
+        }
+        char version[ 4 ];
+
+        recording.write( RECORDING_MAGIC, sizeof(RECORDING_MAGIC) - 1 );
+        put_number( version, RECORDING_VERSION, sizeof(version) );
+        recording.write( version, sizeof(version) );
+    }
+
+    // After the zygote has been forked, which is better done with one thread.
+    // Without it, commands are forked from the main thread and traced there.
+    if( tracerCount > 0 && zygoteSocket >= 0 ) start_tracers();
+}
+
+Subprocess::Subprocess( ) : session( NULL )
+{
+}
+
+void Subprocess::callback_done( )
+{
+}
+
+void Subprocess::callback_write( string, bool )
+{
+}
+
+void Subprocess::trace(string command)
+{
+    start( command );
+    while( session != NULL && dispatch() );
+}
+
+void Subprocess::start(string command, string depfile)
+{
+    begin( command, depfile, depfile.empty() ? traceMode : TRACE_NONE );
+}
+
+void Subprocess::startUntraced(string command)
+{
+    begin( command, "", TRACE_NONE );
+}
+
+// Pass on what a session has to replay, until an entry is parked
+static void pass_replayed( TraceSession *s )
+{
+    while( !s->stalled && s->replayed < s->replay.size() ) {
+        const RecordedEvent &e = s->replay[ s->replayed ++ ];
+
+        switch( e.type ) {
+            case RECORD_ENTRY:
+                s->stalled = entry_callback( s, 0, -1, e.path );
+                break;
+            case RECORD_EXIT:
+                exit_callback( s, e.path, e.exists );
+                break;
+            case RECORD_WRITE:
+            case RECORD_REMOVE:
+                write_callback( s, e.path, e.type == RECORD_REMOVE );
+                break;
+        }
+    }
+}
+
+void Subprocess::begin(const string &command, const string &depfile, TraceMode mode)
+{
+    TraceSession *s;
+    char cwd[ PATH_MAX ];
+    string program;
+    vector<string> args;
+    vector<pair<string, bool> > probes;
+    RecordedEvent e;
+    // Set once when the command is seized, and inherited by every process
+    // and thread it creates. EXITKILL takes them all down if we die.
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE
+        | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+
+    if( session != NULL ) {
+        throw runtime_wexception( "Already running a command" );
+    }
+
+    if( mode == TRACE_SECCOMP || mode == TRACE_PRELOAD ) {
+        options |= PTRACE_O_TRACESECCOMP;
+    }
+
+    if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+        cout << "Executing ";
+    }
+    cout << command << endl;
+
+    s = new TraceSession;
+    s->owner = this;
+    s->command = command;
+    s->mode = mode;
+    s->entryOnly = entryOnly;
+    s->server = NULL;
+    s->tracer = NULL;
+    s->handedBack = false;
+    s->pid = 0;
+    s->detaching = false;
+    s->parked = 0;
+    s->stops = 0;
+    s->stats = stats_rule();
+    s->id = recordedSessions ++;
+    s->replayed = 0;
+    s->stalled = false;
+    s->launchPending = false;
+    gettimeofday( &s->start, NULL );
+    if( recording.is_open() ) record( s->id, RECORD_START, false, command );
+
+    if( !replayFile.empty() ) {
+        list<vector<RecordedEvent> > &runs = recordings[ command ];
+
+        if( runs.empty() ) {
+            delete s;
+            throw runtime_wexception( "No recording of " + command );
+        }
+        s->replay.swap( runs.front() );
+        runs.pop_front();
+        s->launched = s->start;
+        session = s;
+        sessions.push_back( s );
+        return;
+    }
+
+    if( getcwd( cwd, sizeof(cwd) ) == NULL ) {
+        cwd[ 0 ] = 0;
+    }
+    s->cwd = cwd;
+    s->depfile = depfile;
+    // One left from an earlier run would be read if the compiler failed
+    // before writing its own
+    if( !depfile.empty() ) unlink( depfile.c_str() );
+
+    // Simple commands are run directly, rather than paying for a traced shell
+    if( split_command( command, &args ) && find_program( cwd, args[ 0 ], &program, &probes ) ) {
+        if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+            cout << "Running " << program << " without a shell" << endl;
+        }
+    } else {
+        program = "/bin/sh";
+        args.clear();
+        args.push_back( "sh" );
+        args.push_back( "-c" );
+        args.push_back( command );
+    }
+    // An untraced command reports nothing, even the search for its program
+    if( mode == TRACE_NONE && depfile.empty() ) probes.clear();
+    s->program = program;
+    s->args.swap( args );
+    s->options = options;
+    s->launchPending = true;
+
+    // The search is passed on like a traced command's accesses, once the
+    // command is running as far as the callbacks can tell, so a path it
+    // looks at can be parked until it's built. The command is launched
+    // once the search has gone through, from dispatch if it was parked.
+    for( vector<pair<string, bool> >::iterator i = probes.begin(); i != probes.end(); i ++ ) {
+        e.type = RECORD_ENTRY;
+        e.exists = false;
+        e.path = i->first;
+        s->replay.push_back( e );
+        e.type = RECORD_EXIT;
+        e.exists = i->second;
+        s->replay.push_back( e );
+    }
+    session = s;
+    sessions.push_back( s );
+    pass_replayed( s );
+    if( !s->stalled ) launch();
+}
+
+void Subprocess::launch( )
+{
+    TraceSession *s = session;
+    int pipefd[ 2 ];
+    pid_t child;
+    bool forked;
+    char c = 0;
+    string command;
+    vector<string> env;
+
+    s->launchPending = false;
+    if( pipe2( pipefd, O_CLOEXEC ) ) {
+        sessions.remove( s );
+        session = NULL;
+        delete s;
+        throw runtime_wexception( "Could not create pipe" );
+    }
+
+    if( s->mode == TRACE_PRELOAD ) {
+        const char *preload = getenv( "LD_PRELOAD" );
+        string p = preloadLibrary;
+
+        s->server = new PreloadServer( s );
+        if( preload != NULL && *preload ) p = p + ":" + preload;
+        env.push_back( "LD_PRELOAD=" + p );
+        env.push_back( PRELOAD_SOCKET_ENV "=" + s->server->getName() );
+    }
+
+    child = ::launch( pipefd, s->mode, s->program, s->args, env, &forked );
+    gettimeofday( &s->launched, NULL );
+
+    close( pipefd[ 0 ] );
+    // Commands the preload library reports on stay with the main thread,
+    // which serves their connections, and stop little anyway. So do those
+    // forked from here, as waitid on the main thread would take their stops.
+    if( !tracers.empty() && s->mode != TRACE_PRELOAD && !forked ) s->tracer = pick_tracer();
+    if( child < 0 || !(s->tracer != NULL ? seize_on_tracer( s, child, s->options ) : seize( s, child, s->options )) ) {
+        if( child > 0 ) {
+            kill( child, SIGKILL );
+            waitpid( child, NULL, 0 );
+        }
+        close( pipefd[ 1 ] );
+        sessions.remove( s );
+        session = NULL;
+        command = s->command;
+        delete s->server;
+        delete s;
+        throw runtime_wexception( "Could not trace " + command );
+    }
+    if( s->tracer != NULL ) s->tracer->running ++;
+    if( write( pipefd[ 1 ], &c, 1 ) != 1 ) {
+        kill( child, SIGKILL );
+    }
+    close( pipefd[ 1 ] );
+}
+
+// Once a command's first process has exited, what it left running, such as
+// a server or a job put in the background, is let go of rather than waited
+// for, as it may never exit. Without a seccomp filter, as when it was traced
+// with PTRACE_SYSCALL or not at all, it's detached from when it next stops,
+// which it's interrupted for. With one, its filesystem calls would fail
+// untraced, so it's kept traced by the thread's released session instead,
+// which reports nothing, and is killed when we exit.
+static void release_survivors( TraceSession *session )
+{
+    vector<pid_t> tids;
+    TraceeState *from, *to;
+    bool added;
+
+    session->detaching = true;
+    session->tracees.list( &tids );
+    if( tids.empty() ) return;
+    cerr << session->command << ": left " << tids.size() << " threads running, not waiting for them" << endl;
+
+    for( size_t i = 0; i < tids.size(); i ++ ) {
+        from = session->tracees.find( tids[ i ] );
+        if( session->mode != TRACE_SECCOMP && session->mode != TRACE_PRELOAD && !from->parked ) {
+            ptrace( PTRACE_INTERRUPT, tids[ i ], NULL, NULL );
+            continue;
+        }
+        if( released == NULL ) {
+            released = new TraceSession;
+            released->owner = NULL;
+            released->mode = TRACE_SECCOMP;
+            released->entryOnly = false;
+            released->tracer = currentTracer;
+            released->handedBack = false;
+            released->pid = 0;
+            released->detaching = false;
+            released->server = NULL;
+            released->parked = 0;
+            released->stops = 0;
+            released->stats = NULL;
+            released->id = 0;
+            released->replayed = 0;
+            released->stalled = false;
+        }
+        to = released->tracees.insert( tids[ i ], &added );
+        to->announced = from->announced;
+        to->parked = from->parked;
+        to->resume = from->resume;
+        to->cwd = from->cwd;
+        to->ignored = true;
+        session->tracees.erase( tids[ i ] );
+    }
+}
+
+// Handle a change of state of one of a command's processes or threads
+static void handle_event( TraceSession *session, const siginfo_t &info )
+{
+    TraceeTable &tracees = session->tracees;
+    int sig, event, inject;
+    unsigned long msg;
+    pid_t child = info.si_pid;
+    bool insyscall, added, syscallStop, fullTrace, ignored, parked = false;
+    enum __ptrace_request resume;
+    TraceeState *state;
+    SyscallRegs regs;
+    string parentCwd;
+
+    if( info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED ) {
+        state = tracees.find( child );
+        if( state != NULL && !state->announced ) {
+            session->vanished.insert( child );
+        }
+        tracees.erase( child );
+        if( child == session->pid && !session->detaching ) release_survivors( session );
+        return;
+    }
+
+    // Everything until it's let go is time it spends stopped
+    StatsScope scope( session->stats );
+    StatsTimer timer( STAT_STOPPED_TIME );
+    stats_add( STAT_STOPS );
+
+    session->stops ++;
+    sig = info.si_status & 0xff;
+    event = info.si_status >> 8;
+    inject = 0;
+
+    state = tracees.find( child );
+    if( state == NULL ) {
+        // A new process or thread, reporting before its creator's event.
+        // It's traced the same way as its creator.
+        state = tracees.find( creator( child ) );
+        fullTrace = session->mode == TRACE_SYSCALL || (state != NULL && state->fullTrace);
+        ignored = state != NULL && state->ignored;
+        if( state != NULL ) {
+            parentCwd = state->cwd;
+        } else {
+            read_cwd( child, &parentCwd );
+        }
+        state = tracees.insert( child, &added );
+        state->fullTrace = fullTrace;
+        state->ignored = ignored;
+        state->cwd = parentCwd;
+    }
+
+    // Detach from what's left of a command that has exited, and from
+    // anything it starts, which is traced until it reports. A signal it
+    // was stopped for is passed on.
+    if( session->detaching ) {
+        if( (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE)
+                && !ptrace( PTRACE_GETEVENTMSG, child, NULL, &msg ) && !session->vanished.erase( (pid_t)msg ) ) {
+            tracees.insert( (pid_t)msg, &added )->announced = true;
+            state = tracees.find( child );
+        }
+        if( !state->announced ) session->vanished.insert( child );
+        ptrace( PTRACE_DETACH, child, NULL, (void *)(long)(event == 0 && sig != (SIGTRAP | 0x80) ? sig : 0) );
+        tracees.erase( child );
+        return;
+    }
+
+    syscallStop = false;
+    switch( event ) {
+    case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_VFORK:
+    case PTRACE_EVENT_CLONE:
+        // The new process or thread is traced the same way as this one,
+        // and starts in the same directory
+        if( !ptrace( PTRACE_GETEVENTMSG, child, NULL, &msg ) && !session->vanished.erase( (pid_t)msg ) ) {
+            fullTrace = state->fullTrace;
+            ignored = state->ignored;
+            parentCwd = state->cwd;
+            state = tracees.insert( (pid_t)msg, &added );
+            if( added ) {
+                state->fullTrace = fullTrace;
+                state->ignored = ignored;
+                state->cwd = parentCwd;
+            }
+            state->announced = true;
+            state = tracees.find( child );
+        }
+        break;
+
+    case PTRACE_EVENT_EXEC:
+        // A thread other than the leader that calls exec takes over the
+        // leader's tid
+        if( !ptrace( PTRACE_GETEVENTMSG, child, NULL, &msg ) && (pid_t)msg != child ) {
+            TraceeState former;
+
+            state = tracees.find( (pid_t)msg );
+            if( state != NULL ) {
+                if( !state->announced ) session->vanished.insert( (pid_t)msg );
+                swap( former, *state );
+                tracees.erase( (pid_t)msg );
+            }
+            state = tracees.insert( child, &added );
+            swap( *state, former );
+            state->announced = true;
+        }
+        // Threads share a working directory, and chdir isn't traced in
+        // preload mode, so catch up with any change we didn't see
+        read_cwd( child, &state->cwd );
+        if( session->mode == TRACE_PRELOAD ) {
+            // Processes the preload library can't get into need ptrace
+            state->fullTrace = !preload_loaded( child );
+            if( state->fullTrace && get_debug_level( DEBUG_SUBPROCESS ) ) {
+                cout << child << ": not using " << PRELOAD_LIBRARY << ", tracing with ptrace" << endl;
+            }
+        }
+        if( !state->ignored ) {
+            vector<string> args;
+            ToolPolicy policy = find_tool_policy( child, &args );
+
+            if( policy != TOOL_TRACE ) {
+                if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+                    cout << child << ": " << (args.empty() ? "?" : args[ 0 ]) << (policy == TOOL_ARGV ? ", recording its arguments only" : ", not traced") << endl;
+                }
+                if( policy == TOOL_ARGV ) report_arguments( session, state->cwd, args );
+                state = tracees.find( child );
+                state->ignored = true;
+                state->fullTrace = false;
+            }
+        }
+        break;
+
+    case PTRACE_EVENT_STOP:
+        if( sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU ) {
+            // Group stop - leave it stopped until it's sent SIGCONT
+            ptrace( PTRACE_LISTEN, child, NULL, NULL );
+            return;
+        }
+        break;
+
+    case PTRACE_EVENT_SECCOMP:
+        // A fully traced process has already stopped at the entry
+        syscallStop = !state->fullTrace;
+        break;
+
+    case 0:
+        if( sig == (SIGTRAP | 0x80) ) {
+            syscallStop = state->fullTrace || state->insyscall;
+        } else {
+            inject = sig;
+        }
+        break;
+    }
+
+    // An ignored process still runs into the seccomp filter, but is let go
+    // straight away. The exec it is in is let finish, to be reported.
+    if( syscallStop && state->ignored && !state->insyscall ) {
+        ptrace( PTRACE_CONT, child, NULL, NULL );
+        return;
+    }
+
+    // A fully traced process stops on every system call. Otherwise it
+    // only stops at the entry to a call the seccomp filter traps, and
+    // then at its exit if we asked for it, and runs freely otherwise.
+    if( !syscallStop || !get_syscall_regs( child, &regs ) ) {
+        // Keep waiting for the exit of an interrupted call
+        resume = state->fullTrace || state->insyscall ? PTRACE_SYSCALL : PTRACE_CONT;
+        ptrace( resume, child, NULL, (void *)(long)inject );
+        return;
+    }
+
+    if( event == PTRACE_EVENT_SECCOMP ) {
+        insyscall = true;
+    } else if( !state->fullTrace ) {
+        insyscall = false;
+    } else if( regs.op == PTRACE_SYSCALL_INFO_NONE ) {
+        // The kernel sets the return value to -ENOSYS on entry
+        insyscall = regs.returnVal == -ENOSYS;
+    } else {
+        insyscall = regs.op == PTRACE_SYSCALL_INFO_ENTRY;
+    }
+    state->insyscall = insyscall;
+    resume = state->fullTrace || insyscall ? PTRACE_SYSCALL : PTRACE_CONT;
+
+    if( insyscall ) {
+#ifdef DEBUG
+        if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+            debugprint( child, regs.syscall_id, 0 );
+        }
+#endif
+        state->recorded = false;
+        state->info = find_syscall( regs.syscall_id );
+        if( stats_enabled() ) count_syscall_stop( state->info, true );
+        state->changingDir = state->info != NULL && state->info->changesDir;
+        state->writing = EFFECT_NONE;
+        if( state->info != NULL && state->info->pathArg >= 0 && is_read( state->info, regs ) ) {
+            string s;
+
+            if( read_path( child, state, regs, state->info->pathArg, state->info->dirfdArg, &s ) ) {
+                if( session->entryOnly ) session->unchecked.insert( s );
+                parked = entry_callback( session, child, -1, s );
+                // The callback can have run other events for this
+                // command, moving its entry in the table
+                state = tracees.find( child );
+                state->path = s;
+                state->recorded = !session->entryOnly;
+            }
+        } else if( state->info != NULL && state->info->pathArg >= 0 && state->info->effect != EFFECT_NONE ) {
+            // Written paths are reported at the exit, once it's known
+            // the call succeeded
+            if( read_path( child, state, regs, state->info->pathArg, state->info->dirfdArg, &state->path ) ) {
+                state->writing = state->info->effect;
+                if( state->writing == EFFECT_RENAME && !read_path( child, state, regs, state->info->newPathArg, state->info->newDirfdArg, &state->newPath ) ) {
+                    state->newPath.clear();
+                }
+            }
+        }
+        // With nothing to report at the exit, run on to the next
+        // trapped call
+        if( !state->recorded && state->writing == EFFECT_NONE && !state->changingDir && !state->fullTrace ) {
+            state->insyscall = false;
+            resume = PTRACE_CONT;
+        }
+    } else {
+        if( stats_enabled() ) count_syscall_stop( state->info, false );
+        if( state->recorded ) {
+            state->recorded = false;
+            exit_callback( session, state->path, path_exists( state->info, regs.returnVal ) );
+            state = tracees.find( child );
+        }
+        if( state->writing != EFFECT_NONE ) {
+            Effect effect = state->writing;
+
+            state->writing = EFFECT_NONE;
+            if( regs.returnVal >= 0 ) {
+                write_callback( session, state->path, effect == EFFECT_REMOVE || effect == EFFECT_RENAME );
+                if( effect == EFFECT_RENAME && !state->newPath.empty() ) {
+                    write_callback( session, state->newPath, false );
+                }
+            }
+        }
+        if( state->changingDir ) {
+            state->changingDir = false;
+            if( regs.returnVal == 0 ) read_cwd( child, &state->cwd );
+        }
+    }
+
+    if( parked ) {
+        // Left stopped at the entry until it's let go
+        state->parked = true;
+        state->resume = resume;
+        return;
+    }
+    ptrace(resume, child, NULL, NULL);
+}
+
+// Hand a command back to the main thread once every process it started has
+// gone
+static void hand_back( Tracer *t, TraceSession *s )
+{
+    t->sessions.remove( s );
+    hand_over( s, 0, RECORD_DONE, false, "" );
+}
+
+static void *tracer_main( void *arg )
+{
+    Tracer *t = (Tracer *)arg;
+    list<TracerRequest> requests;
+    list<TracerRequest>::iterator r;
+    list<TraceSession *>::iterator i;
+    struct timeval from, to;
+    struct pollfd fd;
+    TraceSession *s;
+    siginfo_t info;
+    char buf[ 64 ];
+    int ret;
+
+    currentTracer = t;
+    fd.fd = t->wake[ 0 ];
+    fd.events = POLLIN;
+    while( 1 ) {
+        gettimeofday( &from, NULL );
+        pthread_mutex_lock( &t->lock );
+        requests.swap( t->requests );
+        pthread_mutex_unlock( &t->lock );
+        for( r = requests.begin(); r != requests.end(); r ++ ) {
+            if( r->type == TracerRequest::SEIZE ) {
+                ret = seize( r->session, r->pid, r->options );
+                if( ret ) t->sessions.push_back( r->session );
+                pthread_mutex_lock( &t->lock );
+                *r->result = ret;
+                pthread_cond_broadcast( &t->seized );
+                pthread_mutex_unlock( &t->lock );
+                continue;
+            }
+            if( r->type == TracerRequest::SETTLE ) {
+                t->settled.insert( r->path );
+                continue;
+            }
+            // The command can have been handed back already, if the thread
+            // was killed while it was held
+            for( i = t->sessions.begin(); i != t->sessions.end() && (*i)->id != r->id; i ++ );
+            if( i != t->sessions.end() ) {
+                resume_tracee( *i, r->pid );
+            } else if( released != NULL ) {
+                resume_tracee( released, r->pid );
+            }
+        }
+        requests.clear();
+        flush_overflow( t );
+
+        // A wakeup can stand for any number of stops
+        while( (ret = next_event( false, &info )) > 0 ) {
+            __atomic_add_fetch( &t->stops, 1, __ATOMIC_RELAXED );
+            s = find_session( t->sessions, info );
+            if( s == NULL ) continue;
+            handle_event( s, info );
+            if( s != released && s->tracees.size() == 0 ) hand_back( t, s );
+        }
+        if( ret < 0 ) {
+            // Whatever we thought was still running has gone without us
+            // seeing it go
+            while( !t->sessions.empty() ) {
+                t->sessions.front()->tracees = TraceeTable();
+                hand_back( t, t->sessions.front() );
+            }
+            if( released != NULL ) released->tracees = TraceeTable();
+        }
+        gettimeofday( &to, NULL );
+        __atomic_add_fetch( &t->busy, (to.tv_sec - from.tv_sec) * 1000000 + (to.tv_usec - from.tv_usec), __ATOMIC_RELAXED );
+
+        while( poll( &fd, 1, -1 ) < 0 && errno == EINTR );
+        while( read( t->wake[ 0 ], buf, sizeof(buf) ) > 0 );
+    }
+    return NULL;
+}
+
+// Pass on an access a tracer thread handed over
+static void take_over( const HandedEvent &e )
+{
+    TraceSession *s = e.session;
+    TracerRequest r;
+
+    switch( e.type ) {
+    case RECORD_ENTRY:
+        // It's held by the tracer until it's let go, unless it wasn't
+        if( !entry_callback( s, e.tid, -1, e.path ) && e.tid > 0 ) {
+            r.type = TracerRequest::RESUME;
+            r.session = s;
+            r.id = s->id;
+            r.pid = e.tid;
+            send_request( s->tracer, r );
+        }
+        break;
+    case RECORD_EXIT:
+        exit_callback( s, e.path, e.exists );
+        break;
+    case RECORD_WRITE:
+    case RECORD_REMOVE:
+        write_callback( s, e.path, e.type == RECORD_REMOVE );
+        break;
+    case RECORD_DONE:
+        s->handedBack = true;
+        s->tracer->running --;
+        break;
+    }
+}
+
+// Finish off a command once every process it started has gone. Returns the
+// object that ran it, or NULL if it can't be finished yet.
+static Subprocess *finish_session( TraceSession *s )
+{
+    Subprocess *owner = s->owner;
+    struct timeval end;
+    struct stat st;
+    double elapsed;
+
+    if( (s->tracer != NULL ? !s->handedBack : s->tracees.size() > 0) || s->parked > 0 || s->replayed < s->replay.size() || s->launchPending ) return NULL;
+
+    // What's left can still park accesses from processes that are gone
+    if( s->server != NULL ) {
+        s->server->drain();
+        if( s->parked > 0 ) return NULL;
+        delete s->server;
+        s->server = NULL;
+    }
+
+    // Now the command has finished, find out which of the paths it looked
+    // up exist, in one pass over the set without duplicates
+    stats_add( STAT_STAT, s->unchecked.size() );
+    for( set<string>::iterator i = s->unchecked.begin(); i != s->unchecked.end(); i ++ ) {
+        exit_callback( s, *i, !stat( i->c_str(), &st ) );
+    }
+
+    // A replayed command has its dependency file's contents in the recording
+    if( !s->depfile.empty() && replayFile.empty() ) {
+        string path = s->depfile;
+        list<string> deps;
+
+        absolute_path( s->cwd, &path );
+        if( parse_depfile( path, &deps ) ) {
+            for( list<string>::iterator i = deps.begin(); i != deps.end(); i ++ ) {
+                absolute_path( s->cwd, &*i );
+                if( !excluded( *i ) ) exit_callback( s, *i, true );
+            }
+            write_callback( s, path, false );
+        } else if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+            cout << s->command << " didn't write " << s->depfile << endl;
+        }
+    }
+    if( recording.is_open() ) record( s->id, RECORD_DONE, false, "" );
+
+    if( get_debug_level( DEBUG_SUBPROCESS ) ) {
+        gettimeofday( &end, NULL );
+        elapsed = (end.tv_sec - s->start.tv_sec) + (end.tv_usec - s->start.tv_usec) / 1000000.0;
+        cout << "Completed " << s->command << " (launched in "
+             << (s->launched.tv_sec - s->start.tv_sec) * 1000000 + (s->launched.tv_usec - s->start.tv_usec) << "us, "
+             << s->stops << " stops, " << (elapsed > 0 ? s->stops / elapsed : 0) << " stops/s)" << endl;
+    }
+
+    sessions.remove( s );
+    delete s;
+    return owner;
+}
+
+bool Subprocess::dispatch( )
+{
+    list<TraceSession *>::iterator i;
+    Subprocess *owner;
+    HandedEvent e;
+    siginfo_t info;
+    TraceSession *s;
+    bool block = true, finished = false;
+    int ret;
+
+    // Commands that finished while callbacks were running
+    for( i = sessions.begin(); i != sessions.end(); ) {
+        owner = finish_session( *i );
+        if( owner == NULL ) {
+            i ++;
+            continue;
+        }
+        owner->session = NULL;
+        // The owner may start its next command from here, or be deleted,
+        // and other commands can have come and gone
+        owner->callback_done();
+        finished = true;
+        i = sessions.begin();
+    }
+    if( finished ) return true;
+    if( sessions.empty() ) return false;
+
+    // Recorded accesses are passed on until one is parked, and a command
+    // is launched once the search for its program has gone through
+    for( i = sessions.begin(); i != sessions.end(); i ++ ) {
+        s = *i;
+        if( s->stalled || (s->replayed == s->replay.size() && !s->launchPending) ) continue;
+        pass_replayed( s );
+        if( !s->stalled && s->launchPending ) s->owner->launch();
+        return true;
+    }
+
+    // Accesses traced on other threads are passed on one at a time, so a
+    // callback that waits for other commands still sees them in order
+    if( take_handed( &e ) ) {
+        take_over( e );
+        return true;
+    }
+
+    // Accesses reported by the preload library or handed over by a tracer
+    // thread don't wake waitid
+    for( i = sessions.begin(); i != sessions.end(); i ++ ) {
+        if( (*i)->server != NULL || (*i)->tracer != NULL ) block = false;
+    }
+
+    ret = next_event( block, &info );
+    if( ret < 0 ) {
+        // No children left, so whatever we thought was still running has
+        // gone without us seeing it go
+        for( i = sessions.begin(); i != sessions.end(); i ++ ) {
+            if( (*i)->tracer != NULL || (*i)->tracees.size() == 0 ) continue;
+            (*i)->tracees = TraceeTable();
+            finished = true;
+        }
+        if( released != NULL ) released->tracees = TraceeTable();
+        if( block || finished ) return true;
+    }
+    if( ret > 0 ) {
+        // Anything else is the zygote, or a process we've stopped tracing
+        s = find_session( sessions, info );
+        if( s != NULL ) handle_event( s, info );
+    } else {
+        wait_servers();
+    }
+    return true;
+}
+
+ParkedAccess *Subprocess::park( )
+{
+    ParkedAccess *access;
+
+    if( currentSession == NULL || currentSession->owner != this || parkRequested || currentTid < 0 ) return NULL;
+
+    parkRequested = true;
+    access = new ParkedAccess;
+    access->session = currentSession;
+    access->tid = currentTid;
+    access->fd = currentFd;
+    access->since = stats_enabled() ? stats_clock() : 0;
+    return access;
+}
+
+void Subprocess::settle( )
+{
+    static set<string> settled;
+    TracerRequest r;
+
+    if( currentSession == NULL || currentSession->owner != this || tracers.empty() ) return;
+    if( !settled.insert( *currentPath ).second ) return;
+
+    // Not urgent, so it waits for something else to wake each tracer
+    r.type = TracerRequest::SETTLE;
+    r.path = *currentPath;
+    for( size_t i = 0; i < tracers.size(); i ++ ) {
+        send_request( tracers[ i ], r, false );
+    }
+}
+
+void Subprocess::resume( ParkedAccess *access )
+{
+    TraceSession *s = access->session;
+    TracerRequest r;
+
+    if( access->since ) stats_add( s->stats, STAT_HELD_TIME, stats_clock() - access->since );
+    s->parked --;
+    if( access->fd >= 0 ) {
+        s->server->resume( access->fd );
+    } else if( access->tid == 0 ) {
+        s->stalled = false;
+    } else if( s->tracer != NULL ) {
+        r.type = TracerRequest::RESUME;
+        r.session = s;
+        r.id = s->id;
+        r.pid = access->tid;
+        send_request( s->tracer, r );
+    } else {
+        resume_tracee( s, access->tid );
     }
+    delete access;
 }
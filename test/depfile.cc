@@ -0,0 +1,66 @@
+#include <depfile.h>
+#include <CUnit/Basic.h>
+#include <stdio.h>
+#include <fstream>
+
+using namespace std;
+
+static const char *file = "depfile_test.d";
+
+int init_depfile(void)
+{
+	return 0;
+}
+
+int clean_depfile(void)
+{
+	remove( file );
+	return 0;
+}
+
+void test_depfile_command(void)
+{
+	string d;
+
+	CU_ASSERT( depfile_for_command( "gcc -MD -c -o obj/a.o a.c", &d ) == true );
+	CU_ASSERT( d == "obj/a.d" );
+	CU_ASSERT( depfile_for_command( "/usr/bin/g++-12 -MMD -MF deps/b.dep -c b.cc -ob.o", &d ) == true );
+	CU_ASSERT( d == "deps/b.dep" );
+	CU_ASSERT( depfile_for_command( "clang -MD -c -o out a.c", &d ) == true );
+	CU_ASSERT( d == "out.d" );
+	CU_ASSERT( depfile_for_command( "ccache gcc -MD -c -o a.o a.c", &d ) == true );
+	CU_ASSERT( d == "a.d" );
+	CU_ASSERT( depfile_for_command( "/usr/bin/distcc ccache g++ -MMD -c -o b.o b.cc", &d ) == true );
+	CU_ASSERT( d == "b.d" );
+
+	// Not a compiler, no dependency file, or more than one command
+	CU_ASSERT( depfile_for_command( "ld -MD -o a.o a.c", &d ) == false );
+	CU_ASSERT( depfile_for_command( "gcc -c -o a.o a.c", &d ) == false );
+	CU_ASSERT( depfile_for_command( "ccache -MD -o a.o", &d ) == false );
+	CU_ASSERT( depfile_for_command( "gcc -MM a.c", &d ) == false );
+	CU_ASSERT( depfile_for_command( "gcc -MD -c -o a.o a.c && touch a", &d ) == false );
+}
+
+void test_depfile_parse(void)
+{
+	list<string> deps;
+	list<string>::iterator i;
+
+	ofstream out( file );
+	out << "obj/a.o: a.c /usr/include/stdio.h \\\n"
+	       " my\\ file.h cost$$.h\n"
+	       "\n"
+	       "/usr/include/stdio.h:\n"
+	       "my\\ file.h:\n";
+	out.close();
+
+	CU_ASSERT( parse_depfile( file, &deps ) == true );
+	CU_ASSERT( deps.size() == 4 );
+	i = deps.begin();
+	CU_ASSERT( *i++ == "a.c" );
+	CU_ASSERT( *i++ == "/usr/include/stdio.h" );
+	CU_ASSERT( *i++ == "my file.h" );
+	CU_ASSERT( *i++ == "cost$.h" );
+
+	CU_ASSERT( parse_depfile( "no such file.d", &deps ) == false );
+}
@@ -0,0 +1,63 @@
+#include <file.h>
+#include <CUnit/Basic.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+using namespace std;
+
+static const char *dir = "canon_test";
+
+int init_file(void)
+{
+	mkdir( dir, 0777 );
+	mkdir( "canon_test/real", 0777 );
+	mkdir( "canon_test/real/sub", 0777 );
+	symlink( "real/sub", "canon_test/link" );
+	symlink( "loop", "canon_test/loop" );
+	return 0;
+}
+
+int clean_file(void)
+{
+	remove( "canon_test/loop" );
+	remove( "canon_test/link" );
+	rmdir( "canon_test/real/sub" );
+	rmdir( "canon_test/real" );
+	rmdir( dir );
+	return 0;
+}
+
+void test_file_canonicalize(void)
+{
+	char cwd[ 4096 ];
+	string here;
+	bool thrown = false;
+
+	CU_ASSERT( getcwd( cwd, sizeof(cwd) ) != NULL );
+	here = string( cwd ) + "/";
+
+	// Tidied up as written, whether it exists or not
+	CU_ASSERT( fileCanonicalize( "a/./b//c" ) == here + "a/b/c" );
+	CU_ASSERT( fileCanonicalize( "a/b/../c/" ) == here + "a/c" );
+	CU_ASSERT( fileCanonicalize( "//" ) == "/" );
+	CU_ASSERT( fileCanonicalize( "/../x/./y" ) == "/x/y" );
+	CU_ASSERT( fileCanonicalize( here + "canon_test/real" ) == here + "canon_test/real" );
+
+	// Symlinks are followed before the .. after them is taken off
+	CU_ASSERT( fileCanonicalize( "canon_test/link/f" ) == here + "canon_test/real/sub/f" );
+	CU_ASSERT( fileCanonicalize( "canon_test/link/../f" ) == here + "canon_test/real/f" );
+	CU_ASSERT( fileCanonicalize( "./canon_test//link/./../sub" ) == here + "canon_test/real/sub" );
+
+	try {
+		fileCanonicalize( "canon_test/loop/f" );
+	} catch( ... ) {
+		thrown = true;
+	}
+	CU_ASSERT( thrown );
+
+	fileResolveSymlinks( false );
+	CU_ASSERT( fileCanonicalize( "canon_test/link/../f" ) == here + "canon_test/f" );
+	fileResolveSymlinks( true );
+}
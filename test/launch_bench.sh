@@ -0,0 +1,44 @@
+#!/bin/sh
+# Launch latency against the size of the loaded makefile, for each way of
+# starting commands. Run from the test directory once ptmake is built:
+#
+#   ./launch_bench.sh [rule counts...]
+#
+# Each makefile has one rule running COMMANDS trivial commands, plus a number
+# of rules that are only parsed, to grow ptmake's address space. The launch
+# time is what ptmake reports with -d subprocess.
+
+MAKE=${MAKE:-$(cd .. && pwd)/make}
+COMMANDS=${COMMANDS:-50}
+SIZES=${*:-0 1000 10000 100000}
+DIR=$(mktemp -d "${TMPDIR:-/var/tmp}/launch_bench.XXXXXX")
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+printf "%8s %12s %12s\n" rules zygote fork
+for rules in $SIZES; do
+    {
+        printf 'all:\n'
+        i=0
+        while [ $i -lt "$COMMANDS" ]; do
+            printf '\ttrue %d\n' $i
+            i=$((i + 1))
+        done
+        printf '\n'
+        i=0
+        while [ $i -lt "$rules" ]; do
+            printf 'unused%d.o: unused%d.c unused%d.h\n\tgcc -c -o unused%d.o unused%d.c\n\n' $i $i $i $i $i
+            i=$((i + 1))
+        done
+    } > Makefile
+
+    printf "%8d" "$rules"
+    for launch in zygote fork; do
+        rm -f makefile.dep
+        "$MAKE" -l $launch -d subprocess 2>&1 \
+            | sed -n 's/.*(launched in \([0-9]*\)us.*/\1/p' \
+            | awk '{ total += $1; n++ } END { printf " %10dus", n ? total / n : 0 }'
+    done
+    printf "\n"
+done
@@ -57,6 +57,54 @@ int main()
 	   return CU_get_error();
    }
 
+   if ((NULL == CU_add_test(pSuite, "test make rules 6", test_make_rules_6))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
+   pSuite = CU_add_suite("Suite depfile", init_depfile, clean_depfile);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if ((NULL == CU_add_test(pSuite, "test depfile command", test_depfile_command))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
+   if ((NULL == CU_add_test(pSuite, "test depfile parse", test_depfile_parse))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
+   pSuite = CU_add_suite("Suite file", init_file, clean_file);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if ((NULL == CU_add_test(pSuite, "test file canonicalize", test_file_canonicalize))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
+   pSuite = CU_add_suite("Suite subprocess", init_subprocess, clean_subprocess);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if ((NULL == CU_add_test(pSuite, "test subprocess background", test_subprocess_background))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
+   if ((NULL == CU_add_test(pSuite, "test subprocess background untraced", test_subprocess_background_untraced))) {
+	   CU_cleanup_registry();
+	   return CU_get_error();
+   }
+
    /* Run all tests using the console interface */
    CU_basic_set_mode(CU_BRM_VERBOSE);
 #if defined(INTERACTIVE)
@@ -1,4 +1,5 @@
 #include "make_rules.h"
+#include "file.h"
 #include <CUnit/Basic.h>
 #include <iostream>
 
@@ -22,7 +23,7 @@ void test_make_rules_1(void)
 	r = new MakeRule();
 
 	// Test non-matching regular rule
-	CU_ASSERT( r->match( "hello", &m ) == false );
+	CU_ASSERT( r->match( fileCanonicalize( "hello" ), &m ) == false );
 
 	delete r;
 }
@@ -34,7 +35,7 @@ void test_make_rules_2(void)
 
 	// Test matching regular rule
 	r->addTarget("hello");
-	CU_ASSERT( r->match( "hello", &m ) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "hello" ), &m ) == true );
 
     delete m;
 	delete r;
@@ -48,19 +49,19 @@ void test_make_rules_3(void)
 	// Test prefix rule
 	r->addTarget("%.hello");
 	CU_ASSERT( r->match( "", &m) == false );
-	CU_ASSERT( r->match( ".hello", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( ".hello" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "a.hello", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "a.hello" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "a.goodbye", &m) == false );
-	CU_ASSERT( r->match( "target.hello", &m) == true );
-	CU_ASSERT( r->expand_command( "echo $@", "target.hello", m ) == string( "echo target.hello" ) );
+	CU_ASSERT( r->match( fileCanonicalize( "a.goodbye" ), &m) == false );
+	CU_ASSERT( r->match( fileCanonicalize( "target.hello" ), &m) == true );
+	CU_ASSERT( r->expand_command( "echo $@", fileCanonicalize( "target.hello" ), m ) == string( "echo target.hello" ) );
     delete m;
-	CU_ASSERT( r->match( "target.hello", &m) == true );
-	CU_ASSERT( r->expand_command( "$@ echo", "target.hello", m ) == string( "target.hello echo" ) );
+	CU_ASSERT( r->match( fileCanonicalize( "target.hello" ), &m) == true );
+	CU_ASSERT( r->expand_command( "$@ echo", fileCanonicalize( "target.hello" ), m ) == string( "target.hello echo" ) );
     delete m;
-	CU_ASSERT( r->match( "target.hello", &m) == true );
-	CU_ASSERT( r->expand_command( "echo $@ $@ echo", "target.hello", m ) == string( "echo target.hello target.hello echo" ) );
+	CU_ASSERT( r->match( fileCanonicalize( "target.hello" ), &m) == true );
+	CU_ASSERT( r->expand_command( "echo $@ $@ echo", fileCanonicalize( "target.hello" ), m ) == string( "echo target.hello target.hello echo" ) );
     delete m;
 
 	delete r;
@@ -74,11 +75,11 @@ void test_make_rules_4(void)
 	// Test suffix rule
 	r->addTarget("hello%");
 	CU_ASSERT( r->match( "", &m) == false );
-	CU_ASSERT( r->match( "hello", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "hello" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "hellothere", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "hellothere" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "goodbyethere", &m ) == false );
+	CU_ASSERT( r->match( fileCanonicalize( "goodbyethere" ), &m ) == false );
 
 	delete r;
 }
@@ -91,11 +92,27 @@ void test_make_rules_5(void)
 	// Test internal wildcard
 	r->addTarget("a%b");
 	CU_ASSERT( r->match( "", &m) == false );
-	CU_ASSERT( r->match( "ab", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "ab" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "acb", &m) == true );
+	CU_ASSERT( r->match( fileCanonicalize( "acb" ), &m) == true );
     delete m;
-	CU_ASSERT( r->match( "bca", &m ) == false );
+	CU_ASSERT( r->match( fileCanonicalize( "bca" ), &m ) == false );
+
+	delete r;
+}
+
+void test_make_rules_6(void)
+{
+	Match *m;
+	r = new MakeRule();
+
+	// Names are matched canonically, but expand as the makefile writes them
+	r->addTarget("./out//%.o");
+	r->addDependency("./%.c", true);
+	CU_ASSERT( r->match( fileCanonicalize( "out/a.o" ), &m) == true );
+	CU_ASSERT( r->expand_command( "cc -o $@ $<", fileCanonicalize( "out/a.o" ), m ) == string( "cc -o ./out//a.o ./a.c" ) );
+	delete m;
+	CU_ASSERT( r->match( "./out/a.o", &m ) == false );
 
 	delete r;
 }
@@ -0,0 +1,36 @@
+#!/bin/sh
+# ptmake's own overhead, without the cost of running any commands. Run from
+# the test directory once ptmake is built:
+#
+#   ./replay_bench.sh project [runs] [make options...]
+#
+# The project is built once from scratch with its accesses recorded, then the
+# recording is replayed RUNS times against an empty dependency database, so
+# every rule is rebuilt each time. The trace mode and other options apply to
+# the recorded build.
+
+MAKE=${MAKE:-$(cd .. && pwd)/make}
+PROJECT=${1:?usage: $0 project [runs] [make options...]}
+RUNS=${2:-5}
+shift
+[ $# -gt 0 ] && shift
+DIR=$(mktemp -d "${TMPDIR:-/var/tmp}/replay_bench.XXXXXX")
+
+trap 'rm -rf "$DIR"' EXIT
+cp -R "$PROJECT" "$DIR/project" || exit 1
+cd "$DIR/project" || exit 1
+
+"$MAKE" -b "$DIR/record.dep" -r "$DIR/trace" "$@" > /dev/null || exit 1
+printf "%d bytes recorded\n" "$(wc -c < "$DIR/trace")"
+
+i=0
+while [ $i -lt "$RUNS" ]; do
+    rm -f "$DIR/replay.dep"
+    start=$(date +%s%N)
+    "$MAKE" -b "$DIR/replay.dep" -R "$DIR/trace" > /dev/null || exit 1
+    end=$(date +%s%N)
+    printf "replay %d: %dus\n" $i $(( (end - start) / 1000 ))
+    i=$((i + 1))
+done
+
+cmp -s "$DIR/record.dep" "$DIR/replay.dep" || echo "replayed dependencies differ from the recorded build"
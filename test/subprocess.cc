@@ -0,0 +1,74 @@
+#include <subprocess.h>
+#include <CUnit/Basic.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+static const char *pidFile = "subprocess_test.pid";
+
+class TestSubprocess : public Subprocess
+{
+public:
+	TestSubprocess( ) : done( false ) { }
+
+	void callback_entry( string ) { }
+	void callback_exit( string, bool ) { }
+	void callback_done( ) { done = true; }
+
+	bool done;
+};
+
+int init_subprocess(void)
+{
+	subprocess_start();
+	return 0;
+}
+
+int clean_subprocess(void)
+{
+	remove( pidFile );
+	return 0;
+}
+
+void test_subprocess_background(void)
+{
+	TestSubprocess sub;
+	time_t start = time( NULL );
+	pid_t pid = 0;
+
+	// What a command leaves running doesn't hold it up, and isn't killed
+	sub.start( string( "sleep 30 & echo $! > " ) + pidFile );
+	while( !sub.done && Subprocess::dispatch() );
+	CU_ASSERT( sub.done );
+	CU_ASSERT( time( NULL ) - start < 10 );
+
+	ifstream in( pidFile );
+	in >> pid;
+	CU_ASSERT( pid > 0 );
+	CU_ASSERT( pid > 0 && kill( pid, 0 ) == 0 );
+	if( pid > 0 ) kill( pid, SIGKILL );
+}
+
+void test_subprocess_background_untraced(void)
+{
+	TestSubprocess sub;
+	pid_t pid = 0;
+	string line;
+
+	// Without a seccomp filter, it's detached, so it outlives us
+	sub.startUntraced( string( "sleep 30 & echo $! > " ) + pidFile );
+	while( !sub.done && Subprocess::dispatch() );
+	CU_ASSERT( sub.done );
+
+	ifstream in( pidFile );
+	in >> pid;
+	CU_ASSERT( pid > 0 );
+	ifstream status( ("/proc/" + to_string( pid ) + "/status").c_str() );
+	while( getline( status, line ) && line.compare( 0, 10, "TracerPid:" ) );
+	CU_ASSERT( line == "TracerPid:\t0" );
+	if( pid > 0 ) kill( pid, SIGKILL );
+}
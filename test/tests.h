@@ -9,3 +9,18 @@ void test_make_rules_2(void);
 void test_make_rules_3(void);
 void test_make_rules_4(void);
 void test_make_rules_5(void);
+void test_make_rules_6(void);
+
+int init_depfile(void);
+int clean_depfile(void);
+void test_depfile_command(void);
+void test_depfile_parse(void);
+
+int init_file(void);
+int clean_file(void);
+void test_file_canonicalize(void);
+
+int init_subprocess(void);
+int clean_subprocess(void);
+void test_subprocess_background(void);
+void test_subprocess_background_untraced(void);